@@ -1,10 +1,29 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#ifdef VCS_FUSE
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#endif
 
 #define VCS_DIR ".myvcs"
 #define OBJECTS_DIR ".myvcs/objects"
@@ -14,8 +33,30 @@
 #define COMMIT_FILE ".myvcs/commit_id"
 #define BRANCHES_DIR ".myvcs/branches"
 #define BRANCH_HEADS ".myvcs/branch_heads"
+#define PROMISOR_FILE ".myvcs/promisor"
+#define PACK_DIR ".myvcs/objects/pack"
+#define WRITE_PACK PACK_DIR "/write.pack"
+#define WRITE_PACK_IDX PACK_DIR "/write.idx"
+#define ALTERNATES_FILE ".myvcs/objects/info/alternates"
+#define BORROWERS_FILE ".myvcs/objects/info/borrowers"
+#define ALTERNATE_DEPTH 5
+#define CONFIG_FILE ".myvcs/config"
+#define COMMIT_GRAPH_FILE ".myvcs/commit-graph"
+#define MAINTENANCE_LOCK ".myvcs/maintenance.lock"
+#define HASH_MAP_FILE ".myvcs/hash-map"
+#define MIGRATE_JOURNAL ".myvcs/migrate-journal"
+#define DICT_DIR ".myvcs/dict"
+#define DICT_ID_SIZE 17          // 16 hex digits of the dictionary's hash
+#define DICT_MAX_SIZE 32768      // deflate cannot look further back than this
+#define DICT_OBJECT_MAX 65536    // larger packed objects are stored raw
+#define TMP_DIR ".myvcs/tmp"
+#define HOOKS_DIR ".myvcs/hooks"
+#define COMMIT_MSG_FILE ".myvcs/COMMIT_MSG"
+#define SORT_MAX_FANIN 64
 
-#define HASH_SIZE 41
+#define HASH_SIZE 65
+#define REPO_FORMAT_VERSION 1
+#define DEFAULT_OBJECT_FORMAT "sha256"
 #define MAX_PATH_LEN 256
 
 #define COLOR_RED "\033[0;31m"
@@ -32,6 +73,113 @@ typedef struct CommitNode {
     int child_count;
 } CommitNode;
 
+/* Snapshot of a commit: one entry per tracked path, sorted by path */
+typedef struct TreeEntry {
+    char *path;
+    char hash[HASH_SIZE];
+    int order;
+} TreeEntry;
+
+typedef struct Tree {
+    TreeEntry *entries;
+    int count;
+    int capacity;
+} Tree;
+
+/*
+ * Location of an object inside a pack file. Compressed entries occupy
+ * `stored` bytes of raw deflate against dictionary `dict`; for raw entries
+ * stored equals size and dict is empty.
+ */
+typedef struct PackedObject {
+    char hash[HASH_SIZE];
+    long offset;
+    long size;
+    long stored;
+    char dict[DICT_ID_SIZE];
+    int pack;
+} PackedObject;
+
+/* A pack directory and its write idx as of loading, to notice changes */
+typedef struct PackDirStamp {
+    struct timespec mtime;
+    long write_idx_size;
+} PackDirStamp;
+
+/* An objects directory borrowed through objects/info/alternates */
+typedef struct Alternate {
+    char *objects;  // absolute path
+    int fd;
+    PackDirStamp stamp;
+} Alternate;
+
+/*
+ * All pack indexes merged and sorted by hash; reloaded when packs change.
+ * The first local_packs packs are this repository's own, the rest belong
+ * to its alternates.
+ */
+typedef struct PackSet {
+    char **packs;
+    int pack_count;
+    int local_packs;
+    PackedObject *objects;
+    int count;
+    int capacity;
+    int loaded;
+    PackDirStamp stamp;
+    struct timespec loaded_at;  // on the coarse clock file times are taken from
+    Alternate *alternates;
+    int alternate_count;
+} PackSet;
+
+/*
+ * Line sorter bounded by the memory budget: lines are kept in memory until
+ * the budget is reached, then sorted runs are spilled to anonymous temp
+ * files and merged on the way out. Under budget nothing touches disk.
+ */
+typedef struct ExtSorter {
+    char **lines;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    size_t budget;
+    FILE **runs;
+    char **heads;
+    int run_count;
+    size_t pos;
+    char *last;
+} ExtSorter;
+
+/* Open-addressing string map, used as a set when values are unused */
+typedef struct StrMap {
+    char **keys;
+    char **values;
+    size_t capacity;
+    size_t count;
+} StrMap;
+
+/* In-process counters reported by --stats; bumped from worker threads too */
+typedef struct Stats {
+    long files_stat;
+    long files_opened;
+    long files_hashed;
+    long bytes_hashed;
+    long objects_written;
+    long loose_hits;
+    long pack_hits;
+    long object_misses;
+    long objects_fetched;
+    long pack_loads;
+    long sort_spills;
+    long parallel_tasks;
+    long parallel_busy_ns;
+    long parallel_capacity_ns;  // wall time times workers, summed per parallel_for
+    long parallel_largest_batch;  // most tasks handed to a single parallel_for
+    long lock_waits;
+    long lock_wait_ns;
+    long first_output_ns;  // monotonic time of the first streamed record
+} Stats;
+
 /* Commit Graph Edge List (Graph) */
 typedef struct GraphEdge {
     char from[64];
@@ -41,6 +189,30 @@ typedef struct GraphEdge {
 
 CommitNode *commit_tree_root = NULL; // Tree root
 GraphEdge *commit_graph = NULL;      // Graph edge list
+PackSet pack_set = {0};              // Lazily loaded pack indexes
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static long tmp_sequence = 0;
+long memory_limit = -1;                 // bytes, 0 = unlimited; -1 = not read yet
+Stats stats = {0};
+int thread_override = 0;                // --threads, wins over core.threads
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/*
+ * Per-process repository state. main() finds the repository once and
+ * moves to its root, so the path macros above stay root-relative; HEAD,
+ * the config and the objects directory are read or opened on first use.
+ */
+typedef struct Repository {
+    char root[PATH_MAX];
+    char prefix[PATH_MAX];      // cwd below the root: "" or "sub/dir/"
+    char branch[MAX_PATH_LEN];  // cached HEAD, "" until read
+    StrMap config;
+    int config_loaded;
+    int objects_fd;             // -1 until first opened
+} Repository;
+
+Repository repo = {.objects_fd = -1};
 
 void add_commit_edge(const char *from, const char *to) {
     GraphEdge *edge = (GraphEdge *)malloc(sizeof(GraphEdge));
@@ -51,483 +223,6494 @@ void add_commit_edge(const char *from, const char *to) {
 }
 
 void get_current_branch(char *branch) {
-    FILE *f = fopen(HEAD_FILE, "r");
+    if (!repo.branch[0]) {
+        FILE *f = fopen(HEAD_FILE, "r");
+        if (f) {
+            if (fgets(repo.branch, sizeof(repo.branch), f)) repo.branch[strcspn(repo.branch, "\n")] = 0;
+            fclose(f);
+        } else {
+            strcpy(repo.branch, "master");
+        }
+    }
+    snprintf(branch, MAX_PATH_LEN, "%s", repo.branch);
+}
+
+void set_current_branch(const char *branch) {
+    FILE *f = fopen(HEAD_FILE, "w");
     if (f) {
-        fgets(branch, MAX_PATH_LEN, f);
-        branch[strcspn(branch, "\n")] = 0;
+        fprintf(f, "%s", branch);
         fclose(f);
-    } else {
-        strcpy(branch, "master");
     }
+    snprintf(repo.branch, sizeof(repo.branch), "%s", branch);
 }
 
 void get_branch_log_path(char *path) {
     char branch[MAX_PATH_LEN];
     get_current_branch(branch);
-    snprintf(path, MAX_PATH_LEN, "%s/%s.log", BRANCHES_DIR, branch);
+    if (snprintf(path, MAX_PATH_LEN, "%s/%s.log", BRANCHES_DIR, branch) >= MAX_PATH_LEN) path[0] = 0;
 }
 
-void simple_hash_file(const char *filename, char *output) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        strcpy(output, "0000000000000000000000000000000000000000");
-        return;
+/* Names too long to fit yield "", which no object can be opened as */
+void object_path(const char *hash, char *path) {
+    if (snprintf(path, MAX_PATH_LEN, "%s/%s", OBJECTS_DIR, hash) >= MAX_PATH_LEN) path[0] = 0;
+}
+
+static size_t strmap_slot(const StrMap *map, const char *key) {
+    unsigned long h = 5381;
+    for (const char *p = key; *p; p++) h = ((h << 5) + h) + (unsigned char)*p;
+    size_t i = h & (map->capacity - 1);
+    while (map->keys[i] && strcmp(map->keys[i], key) != 0) i = (i + 1) & (map->capacity - 1);
+    return i;
+}
+
+/* Inserts or replaces; returns 1 if the key was new */
+int strmap_put(StrMap *map, const char *key, const char *value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        StrMap grown = {0};
+        grown.capacity = map->capacity ? map->capacity * 2 : 256;
+        grown.keys = calloc(grown.capacity, sizeof(char *));
+        grown.values = calloc(grown.capacity, sizeof(char *));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!map->keys[i]) continue;
+            size_t j = strmap_slot(&grown, map->keys[i]);
+            grown.keys[j] = map->keys[i];
+            grown.values[j] = map->values[i];
+        }
+        grown.count = map->count;
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    size_t i = strmap_slot(map, key);
+    int is_new = map->keys[i] == NULL;
+    if (is_new) {
+        map->keys[i] = strdup(key);
+        map->count++;
+    } else {
+        free(map->values[i]);
+    }
+    map->values[i] = value ? strdup(value) : NULL;
+    return is_new;
+}
+
+const char *strmap_get(const StrMap *map, const char *key) {
+    if (!map->capacity) return NULL;
+    size_t i = strmap_slot(map, key);
+    if (!map->keys[i]) return NULL;
+    return map->values[i] ? map->values[i] : "";
+}
+
+void strmap_free(StrMap *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->keys[i]);
+        free(map->values[i]);
     }
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(*map));
+}
 
-    unsigned long hash = 5381;
-    int c;
-    while ((c = fgetc(file)) != EOF) {
-        hash = ((hash << 5) + hash) + c;
+/* Parses the config once per process; a repeated key keeps its last value */
+static void load_config(void) {
+    repo.config_loaded = 1;
+    FILE *f = fopen(CONFIG_FILE, "r");
+    if (!f) return;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char k[128], v[384];
+        if (line[0] == '#' || sscanf(line, " %127[^= ] = %383[^\n]", k, v) != 2) continue;
+        strmap_put(&repo.config, k, v);
     }
-    fclose(file);
-    sprintf(output, "%040lx", hash);
+    fclose(f);
 }
 
-void copy_file(const char *src, const char *dest) {
-    FILE *fsrc = fopen(src, "rb");
-    FILE *fdest = fopen(dest, "wb");
-    if (!fsrc || !fdest) {
-        if (fsrc) fclose(fsrc);
-        if (fdest) fclose(fdest);
-        return;
+/* Reads "key = value" from the repository config; returns 1 if present */
+int get_config(const char *key, char *value, size_t size) {
+    if (!repo.config_loaded) load_config();
+    const char *v = strmap_get(&repo.config, key);
+    if (!v) return 0;
+    snprintf(value, size, "%s", v);
+    return 1;
+}
+
+long get_config_long(const char *key, long fallback) {
+    char value[64];
+    if (!get_config(key, value, sizeof(value))) return fallback;
+    return strtol(value, NULL, 10);
+}
+
+int set_config(const char *key, const char *value) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", CONFIG_FILE, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (!out) return -1;
+    FILE *in = fopen(CONFIG_FILE, "r");
+    char line[512];
+    int written = 0;
+    while (in && fgets(line, sizeof(line), in)) {
+        char k[128];
+        if (line[0] != '#' && sscanf(line, " %127[^= ] =", k) == 1 && strcmp(k, key) == 0) {
+            if (!written) fprintf(out, "%s = %s\n", key, value);
+            written = 1;
+        } else {
+            fputs(line, out);
+        }
     }
-    char buf[1024];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fsrc)) > 0) {
-        fwrite(buf, 1, n, fdest);
+    if (in) fclose(in);
+    if (!written) fprintf(out, "%s = %s\n", key, value);
+    if (fclose(out) != 0 || rename(tmp, CONFIG_FILE) != 0) {
+        remove(tmp);
+        return -1;
     }
-    fclose(fsrc);
-    fclose(fdest);
+    if (repo.config_loaded) strmap_put(&repo.config, key, value);
+    return 0;
 }
 
-void init_repo() {
-    if (mkdir(VCS_DIR, 0755) == 0) {
-        mkdir(OBJECTS_DIR, 0755);
-        mkdir(BRANCHES_DIR, 0755);
-        mkdir(BRANCH_HEADS, 0755);
+/* Drops the cached state, for code that moves to another repository */
+void forget_repository(void) {
+    repo.branch[0] = 0;
+    strmap_free(&repo.config);
+    repo.config_loaded = 0;
+    if (repo.objects_fd >= 0) close(repo.objects_fd);
+    repo.objects_fd = -1;
+}
 
-        FILE *f = fopen(INDEX_FILE, "w");
-        if (f) fclose(f);
-        f = fopen(HEAD_FILE, "w");
-        if (f) {
-            fprintf(f, "master");
-            fclose(f);
+/*
+ * Walks up from the cwd to the nearest directory holding .myvcs and moves
+ * there, remembering the way back down as repo.prefix. Returns -1 outside
+ * any repository.
+ */
+int discover_repository(void) {
+    char cwd[PATH_MAX], path[PATH_MAX + 16];
+    if (!getcwd(cwd, sizeof(cwd))) return -1;
+    snprintf(repo.root, sizeof(repo.root), "%s", cwd);
+    for (;;) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", repo.root, VCS_DIR);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) break;
+        char *slash = strrchr(repo.root, '/');
+        if (!slash || strcmp(repo.root, "/") == 0) return -1;
+        slash[slash == repo.root] = 0;  // keep "/" itself
+    }
+    const char *rest = cwd + strlen(repo.root);
+    while (*rest == '/') rest++;
+    snprintf(repo.prefix, sizeof(repo.prefix), "%s%s", rest, *rest ? "/" : "");
+    return chdir(repo.root);
+}
+
+/*
+ * Resolves "." and ".." in a root-relative path. Returns -1 when a ".."
+ * would climb above the root, which out then stands in for.
+ */
+static int canonical_path(const char *path, char *out, size_t size) {
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", path);
+    size_t len = 0;
+    int escaped = 0;
+    out[0] = 0;
+    for (char *save, *part = strtok_r(copy, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) continue;
+        if (strcmp(part, "..") == 0) {
+            if (len == 0) escaped = 1;
+            while (len > 0 && out[--len] != '/') {}
+            out[len] = 0;
+            continue;
         }
+        len += snprintf(out + len, size - len, "%s%s", len ? "/" : "", part);
+        if (len >= size) len = size - 1;
+    }
+    return escaped ? -1 : 0;
+}
 
-        char log_path[MAX_PATH_LEN];
-        get_branch_log_path(log_path);
-        f = fopen(log_path, "w");
-        if (f) fclose(f);
+/*
+ * A path argument given relative to the directory vcs was started in,
+ * made root-relative with "." and ".." resolved. Absolute paths below the
+ * root are made relative too; other absolute paths are kept as given.
+ * Returns NULL for a relative path that leaves the repository root.
+ */
+const char *repo_path(const char *arg, char *out, size_t size) {
+    char path[PATH_MAX];
+    const char *base = repo.prefix;
+    size_t root_len = strcmp(repo.root, "/") == 0 ? 0 : strlen(repo.root);
+    if (arg[0] == '/') {
+        if (strncmp(arg, repo.root, root_len) != 0 || (arg[root_len] != '/' && arg[root_len] != 0)) {
+            snprintf(out, size, "%s", arg);
+            return out;
+        }
+        arg += root_len;
+        base = "";
+    }
+    if (snprintf(path, sizeof(path), "%s%s", base, arg) >= (int)sizeof(path)) return NULL;
+    return canonical_path(path, out, size) == 0 ? out : NULL;
+}
 
-        snprintf(log_path, MAX_PATH_LEN, "%s/master.txt", BRANCH_HEADS);
-        f = fopen(log_path, "w");
-        if (f) fclose(f);
+/* Objects are looked up relative to one directory fd, opened once */
+static int objects_dir_fd(void) {
+    int fd = __atomic_load_n(&repo.objects_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) return fd;
+    int expected = -1;
+    fd = open(OBJECTS_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && !__atomic_compare_exchange_n(&repo.objects_fd, &expected, fd, 0, __ATOMIC_ACQ_REL,
+                                                 __ATOMIC_ACQUIRE)) {
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
 
-        printf("Repository initialized with master branch.\n");
-    } else {
-        printf("Repository already exists.\n");
+size_t parse_size(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
     }
+    return value > 0 ? (size_t)value : 0;
 }
 
-void add_file(const char *filename) {
-    FILE *index = fopen(INDEX_FILE, "a");
-    if (!index) return;
-    fprintf(index, "%s\n", filename);
-    fclose(index);
-    printf("Added '%s' to staging.\n", filename);
+/* --memory-limit wins over core.memoryLimit; neither means unlimited */
+size_t get_memory_limit(void) {
+    if (memory_limit < 0) {
+        char value[64];
+        memory_limit = get_config("core.memoryLimit", value, sizeof(value)) ? (long)parse_size(value) : 0;
+    }
+    return (size_t)memory_limit;
+}
+
+/* share: how many sorters the caller keeps alive at once */
+void extsort_init(ExtSorter *s, int share) {
+    memset(s, 0, sizeof(*s));
+    s->budget = get_memory_limit() / (share > 0 ? share : 1);
 }
 
-void write_object(const char *filename, const char *hash) {
+static FILE *spill_file(void) {
     char path[MAX_PATH_LEN];
-    snprintf(path, sizeof(path), "%s/%s", OBJECTS_DIR, hash);
-    if (access(path, F_OK) == 0) return;
+    mkdir(TMP_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/sort-XXXXXX", TMP_DIR);
+    int fd = mkstemp(path);
+    if (fd < 0) return NULL;
+    unlink(path);
+    return fdopen(fd, "w+");
+}
 
-    FILE *src = fopen(filename, "rb");
-    FILE *dest = fopen(path, "wb");
-    if (!src || !dest) return;
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    char buffer[1024];
-    size_t n;
-    while ((n = fread(buffer, 1, sizeof(buffer), src)) > 0) {
-        fwrite(buffer, 1, n, dest);
+static void extsort_spill(ExtSorter *s) {
+    FILE *run = spill_file();
+    if (!run) return;  // no disk space either: keep going in memory
+    qsort(s->lines, s->count, sizeof(char *), compare_lines);
+    for (size_t i = 0; i < s->count; i++) {
+        fprintf(run, "%s\n", s->lines[i]);
+        free(s->lines[i]);
     }
-
-    fclose(src);
-    fclose(dest);
+    s->runs = realloc(s->runs, sizeof(FILE *) * (s->run_count + 1));
+    s->runs[s->run_count++] = run;
+    STAT_ADD(sort_spills, 1);
+    s->count = 0;
+    s->bytes = 0;
 }
 
-CommitNode *create_commit_node(const char *id, const char *message, CommitNode *parent) {
-    CommitNode *node = (CommitNode *)malloc(sizeof(CommitNode));
-    strcpy(node->id, id);
-    strcpy(node->message, message);
-    node->parent = parent;
-    node->children = NULL;
-    node->child_count = 0;
-    if (parent) {
-        parent->children = realloc(parent->children, sizeof(CommitNode *) * (parent->child_count + 1));
-        parent->children[parent->child_count++] = node;
+void extsort_add(ExtSorter *s, const char *line) {
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 1024;
+        s->lines = realloc(s->lines, sizeof(char *) * s->capacity);
     }
-    return node;
+    s->lines[s->count++] = strdup(line);
+    s->bytes += strlen(line) + 1 + 2 * sizeof(char *);
+    if (s->budget && s->bytes >= s->budget) extsort_spill(s);
 }
 
-void commit(const char *message) {
-    char commit_id[64];
-    time_t now = time(NULL);
-    snprintf(commit_id, sizeof(commit_id), "%ld", now);
+static char *read_run_line(FILE *run) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, run);
+    if (n <= 0) {
+        free(line);
+        return NULL;
+    }
+    if (line[n - 1] == '\n') line[n - 1] = 0;
+    return line;
+}
 
-    FILE *index = fopen(INDEX_FILE, "r");
-    if (!index) return;
+static int extsort_min_run(ExtSorter *s) {
+    int best = -1;
+    for (int r = 0; r < s->run_count; r++) {
+        if (s->heads[r] && (best < 0 || strcmp(s->heads[r], s->heads[best]) < 0)) best = r;
+    }
+    return best;
+}
 
-    char filename[MAX_PATH_LEN];
-    char log_path[MAX_PATH_LEN];
-    get_branch_log_path(log_path);
+static void extsort_start_merge(ExtSorter *s) {
+    s->heads = realloc(s->heads, sizeof(char *) * s->run_count);
+    for (int r = 0; r < s->run_count; r++) {
+        rewind(s->runs[r]);
+        s->heads[r] = read_run_line(s->runs[r]);
+    }
+}
 
-    FILE *log = fopen(log_path, "a");
-    if (!log) {
-        fclose(index);
+/* Sorts what is left; with spilled runs, merges them down to SORT_MAX_FANIN */
+void extsort_finish(ExtSorter *s) {
+    if (!s->run_count) {
+        qsort(s->lines, s->count, sizeof(char *), compare_lines);
         return;
     }
+    if (s->count) extsort_spill(s);
+    while (s->run_count > SORT_MAX_FANIN) {
+        ExtSorter group = {0};
+        group.runs = s->runs;
+        group.run_count = SORT_MAX_FANIN;
+        extsort_start_merge(&group);
+        FILE *merged = spill_file();
+        int r;
+        while (merged && (r = extsort_min_run(&group)) >= 0) {
+            fprintf(merged, "%s\n", group.heads[r]);
+            free(group.heads[r]);
+            group.heads[r] = read_run_line(group.runs[r]);
+        }
+        for (r = 0; r < SORT_MAX_FANIN; r++) fclose(s->runs[r]);
+        free(group.heads);
+        memmove(s->runs, s->runs + SORT_MAX_FANIN, sizeof(FILE *) * (s->run_count - SORT_MAX_FANIN));
+        s->run_count -= SORT_MAX_FANIN;
+        s->runs[s->run_count++] = merged;
+    }
+    extsort_start_merge(s);
+}
 
-    fprintf(log, "commit %s\nmessage: %s\nfiles:\n", commit_id, message);
-
-    snprintf(log_path, MAX_PATH_LEN, "%s/", OBJECTS_DIR);
+/* Next line in sorted order; valid until the following call */
+const char *extsort_next(ExtSorter *s) {
+    free(s->last);
+    s->last = NULL;
+    if (!s->run_count) {
+        if (s->pos >= s->count) return NULL;
+        s->last = s->lines[s->pos];
+        s->lines[s->pos++] = NULL;
+        return s->last;
+    }
+    int r = extsort_min_run(s);
+    if (r < 0) return NULL;
+    s->last = s->heads[r];
+    s->heads[r] = read_run_line(s->runs[r]);
+    return s->last;
+}
 
-    char branch[MAX_PATH_LEN];
-    get_current_branch(branch);
-    char head_file[MAX_PATH_LEN];
-    snprintf(head_file, MAX_PATH_LEN, "%s/%s.txt", BRANCH_HEADS, branch);
-    FILE *head = fopen(head_file, "a");
+int extsort_spilled(const ExtSorter *s) {
+    return s->run_count > 0;
+}
 
-    while (fgets(filename, sizeof(filename), index)) {
-        filename[strcspn(filename, "\n")] = 0;
-        char hash[HASH_SIZE];
-        simple_hash_file(filename, hash);
-        write_object(filename, hash);
-        fprintf(log, "- %s : %s\n", filename, hash);
-        if (head) fprintf(head, "- %s : %s\n", filename, hash);
+void extsort_free(ExtSorter *s) {
+    for (size_t i = s->pos; i < s->count; i++) free(s->lines[i]);
+    free(s->lines);
+    for (int r = 0; r < s->run_count; r++) {
+        if (s->heads) free(s->heads[r]);
+        fclose(s->runs[r]);
     }
+    free(s->heads);
+    free(s->runs);
+    free(s->last);
+    memset(s, 0, sizeof(*s));
+}
 
-    fprintf(log, "\n");
-    fclose(index);
-    fclose(log);
-    if (head) fclose(head);
+/* Queues a manifest entry so that the latest one for each path sorts first */
+void manifest_sort_add(ExtSorter *s, const char *path, const char *hash, long seq) {
+    char line[MAX_PATH_LEN + HASH_SIZE + 32];
+    snprintf(line, sizeof(line), "%s\x01%016lx\x01%s", path, LONG_MAX - seq, hash);
+    extsort_add(s, line);
+}
 
-    FILE *commit_file = fopen(COMMIT_FILE, "w");
-    if (commit_file) {
-        fprintf(commit_file, "%s", commit_id);
-        fclose(commit_file);
+/* Next path with its latest hash; path must start empty and be passed back unchanged */
+int manifest_sort_next(ExtSorter *s, char *path, char *hash) {
+    const char *line;
+    while ((line = extsort_next(s)) != NULL) {
+        const char *sep = strchr(line, '\x01');
+        if (!sep) continue;
+        size_t len = sep - line;
+        if (len >= MAX_PATH_LEN) continue;
+        if (strlen(path) == len && strncmp(path, line, len) == 0) continue;
+        memcpy(path, line, len);
+        path[len] = 0;
+        snprintf(hash, HASH_SIZE, "%s", strrchr(line, '\x01') + 1);
+        return 1;
     }
+    return 0;
+}
 
-    index = fopen(INDEX_FILE, "w");
-    if (index) fclose(index);
-
-    // Add to commit tree
-    CommitNode *new_node = create_commit_node(commit_id, message, commit_tree_root);
-    if (commit_tree_root) add_commit_edge(commit_tree_root->id, commit_id);
-    commit_tree_root = new_node;
+/* Runs fn(arg, i) for i in [0, count) on up to jobs threads */
+typedef struct ParallelJob {
+    int next;
+    int count;
+    pthread_mutex_t lock;
+    void (*fn)(void *arg, int i);
+    void *arg;
+} ParallelJob;
 
-    printf(COLOR_GREEN "Committed as %s\n" COLOR_RESET, commit_id);
+static long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
-int is_tracked(const char *filename, char *last_hash_out) {
-    char log_path[MAX_PATH_LEN];
-    get_branch_log_path(log_path);
-    FILE *log = fopen(log_path, "r");
-    if (!log) return 0;
+/* pthread_mutex_lock that accounts for the time spent blocked (--stats) */
+void timed_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_trylock(lock) == 0) return;
+    long start = monotonic_ns();
+    pthread_mutex_lock(lock);
+    STAT_ADD(lock_waits, 1);
+    STAT_ADD(lock_wait_ns, monotonic_ns() - start);
+}
 
-    char line[512], last_hash[HASH_SIZE] = "";
-    int found = 0;
-    while (fgets(line, sizeof(line), log)) {
-        if (strncmp(line, "- ", 2) == 0 && strstr(line, filename)) {
-            sscanf(line, "- %*s : %40s", last_hash);
-            found = 1;
-        }
+static void *parallel_worker(void *p) {
+    ParallelJob *job = p;
+    long busy = 0;
+    for (;;) {
+        timed_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) break;
+        long start = monotonic_ns();
+        job->fn(job->arg, i);
+        busy += monotonic_ns() - start;
     }
-    fclose(log);
-    if (found && last_hash_out) strcpy(last_hash_out, last_hash);
-    return found;
+    STAT_ADD(parallel_busy_ns, busy);
+    return NULL;
 }
 
-void show_status() {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
+int default_jobs(void) {
+    if (thread_override > 0) return thread_override;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long jobs = get_config_long("core.threads", cpus > 0 ? cpus : 1);
+    return jobs > 0 ? (int)jobs : 1;
+}
 
-    if ((dir = opendir(".")) == NULL) {
-        perror("opendir");
+void parallel_for(int count, int jobs, void (*fn)(void *arg, int i), void *arg) {
+    ParallelJob job = {0, count, PTHREAD_MUTEX_INITIALIZER, fn, arg};
+    if (jobs > count) jobs = count;
+    long start = monotonic_ns();
+    STAT_ADD(parallel_tasks, count);
+    long largest = __atomic_load_n(&stats.parallel_largest_batch, __ATOMIC_RELAXED);
+    while (count > largest && !__atomic_compare_exchange_n(&stats.parallel_largest_batch, &largest, count, 0,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    if (jobs <= 1) {
+        parallel_worker(&job);
+        STAT_ADD(parallel_capacity_ns, monotonic_ns() - start);
         return;
     }
+    pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+    int started = 0;
+    for (int t = 0; t < jobs; t++) {
+        if (pthread_create(&threads[t], NULL, parallel_worker, &job) == 0) started++;
+    }
+    if (started == 0) parallel_worker(&job);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    STAT_ADD(parallel_capacity_ns, (monotonic_ns() - start) * (started ? started : 1));
+}
 
-    printf("Changes in working directory:\n");
-    int changes = 0;
+/*
+ * Object hashing. The algorithm is a property of the repository
+ * (core.objectFormat); djb2 is the original 64-bit hash and is kept so
+ * existing repositories stay readable until they are migrated.
+ */
+struct HashCtx;
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
-        
-        if (stat(entry->d_name, &file_stat) == -1) continue;
-        if (S_ISDIR(file_stat.st_mode)) continue;
+typedef struct HashAlgo {
+    const char *name;
+    int hex_len;
+    void (*init)(struct HashCtx *ctx);
+    void (*update)(struct HashCtx *ctx, const unsigned char *data, size_t len);
+    void (*final)(struct HashCtx *ctx, char *hex);
+} HashAlgo;
 
-        if (strcmp(entry->d_name, "vcs") == 0 || strncmp(entry->d_name, ".myvcs", 6) == 0) continue;
+typedef struct Sha1Ctx {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t buf_len;
+} Sha1Ctx;
 
-        char hash[HASH_SIZE];
-        simple_hash_file(entry->d_name, hash);
+typedef struct Sha256Ctx {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t buf_len;
+} Sha256Ctx;
 
-        char last_hash[HASH_SIZE];
-        int tracked = is_tracked(entry->d_name, last_hash);
+typedef struct Blake3Ctx {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    unsigned char block[64];
+    size_t block_len;
+    int blocks_compressed;
+    uint32_t cv_stack[54][8];
+    int cv_stack_len;
+} Blake3Ctx;
 
-        if (!tracked) {
-            printf(COLOR_YELLOW "  new file: %s\n" COLOR_RESET, entry->d_name);
-            changes++;
-        } else if (strcmp(hash, last_hash) != 0) {
-            printf(COLOR_RED "  modified: %s\n" COLOR_RESET, entry->d_name);
-            changes++;
+typedef struct HashCtx {
+    const HashAlgo *algo;
+    union {
+        unsigned long djb2;
+        Sha1Ctx sha1;
+        Sha256Ctx sha256;
+        Blake3Ctx blake3;
+    } u;
+} HashCtx;
+
+static uint32_t rotl32(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+static uint32_t rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static uint32_t load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t load_le32(const unsigned char *p) {
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static void hex_words(const uint32_t *words, int count, int little_endian, char *hex) {
+    for (int i = 0; i < count; i++) {
+        for (int b = 0; b < 4; b++) {
+            int shift = little_endian ? 8 * b : 24 - 8 * b;
+            sprintf(hex + i * 8 + b * 2, "%02x", (words[i] >> shift) & 0xff);
         }
     }
-    closedir(dir);
+}
 
-    if (changes == 0) {
-        printf("  (no changes detected)\n");
+static void djb2_init(HashCtx *ctx) { ctx->u.djb2 = 5381; }
+
+static void djb2_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    unsigned long hash = ctx->u.djb2;
+    for (size_t i = 0; i < len; i++) hash = ((hash << 5) + hash) + data[i];
+    ctx->u.djb2 = hash;
+}
+
+static void djb2_final(HashCtx *ctx, char *hex) { sprintf(hex, "%040lx", ctx->u.djb2); }
+
+/* SHA-1 and SHA-256 share Merkle-Damgard buffering; only the block function differs */
+static void md_update(unsigned char *buf, size_t *buf_len, uint64_t *total, const unsigned char *data,
+                      size_t len, void (*block)(void *state, const unsigned char *p), void *state) {
+    *total += len;
+    if (*buf_len) {
+        size_t take = 64 - *buf_len < len ? 64 - *buf_len : len;
+        memcpy(buf + *buf_len, data, take);
+        *buf_len += take;
+        data += take;
+        len -= take;
+        if (*buf_len < 64) return;
+        block(state, buf);
+        *buf_len = 0;
     }
+    for (; len >= 64; data += 64, len -= 64) block(state, data);
+    memcpy(buf, data, len);
+    *buf_len = len;
 }
 
-void show_log() {
-    char log_path[MAX_PATH_LEN];
-    get_branch_log_path(log_path);
-    FILE *log = fopen(log_path, "r");
-    if (!log) return;
-    char line[256];
-    while (fgets(line, sizeof(line), log)) {
-        printf("%s", line);
+static void md_pad(unsigned char *buf, size_t buf_len, uint64_t total,
+                   void (*block)(void *state, const unsigned char *p), void *state) {
+    uint64_t bits = total * 8;
+    buf[buf_len++] = 0x80;
+    if (buf_len > 56) {
+        memset(buf + buf_len, 0, 64 - buf_len);
+        block(state, buf);
+        buf_len = 0;
     }
-    fclose(log);
+    memset(buf + buf_len, 0, 56 - buf_len);
+    for (int i = 0; i < 8; i++) buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    block(state, buf);
 }
 
-void create_branch(const char *branch_name) {
-    char path[MAX_PATH_LEN];
-    snprintf(path, sizeof(path), "%s/%s.log", BRANCHES_DIR, branch_name);
-    FILE *f = fopen(path, "w");
-    if (!f) {
-        printf("Failed to create branch.\n");
-        return;
+static void sha1_block(void *state, const unsigned char *p) {
+    uint32_t *h = state, w[80];
+    for (int i = 0; i < 16; i++) w[i] = load_be32(p + 4 * i);
+    for (int i = 16; i < 80; i++) w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) f = (b & c) | (~b & d), k = 0x5a827999;
+        else if (i < 40) f = b ^ c ^ d, k = 0x6ed9eba1;
+        else if (i < 60) f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+        else f = b ^ c ^ d, k = 0xca62c1d6;
+        uint32_t t = rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
     }
-    fclose(f);
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
 
-    // Copy HEAD from current branch
-    char current[MAX_PATH_LEN];
-    get_current_branch(current);
-    char from[MAX_PATH_LEN], to[MAX_PATH_LEN];
-    snprintf(from, MAX_PATH_LEN, "%s/%s.txt", BRANCH_HEADS, current);
-    snprintf(to, MAX_PATH_LEN, "%s/%s.txt", BRANCH_HEADS, branch_name);
-    copy_file(from, to);
+static void sha1_init(HashCtx *ctx) {
+    static const uint32_t iv[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    memcpy(ctx->u.sha1.h, iv, sizeof(iv));
+    ctx->u.sha1.len = 0;
+    ctx->u.sha1.buf_len = 0;
+}
 
-    printf("Branch '%s' created.\n", branch_name);
+static void sha1_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    Sha1Ctx *c = &ctx->u.sha1;
+    md_update(c->buf, &c->buf_len, &c->len, data, len, sha1_block, c->h);
 }
 
-void checkout_branch(const char *branch_name) {
-    char path[MAX_PATH_LEN];
-    snprintf(path, sizeof(path), "%s/%s.txt", BRANCH_HEADS, branch_name);
-    if (access(path, F_OK) != 0) {
-        printf("Branch '%s' does not exist.\n", branch_name);
-        return;
+static void sha1_final(HashCtx *ctx, char *hex) {
+    Sha1Ctx *c = &ctx->u.sha1;
+    md_pad(c->buf, c->buf_len, c->len, sha1_block, c->h);
+    hex_words(c->h, 5, 0, hex);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/* Also BLAKE3's IV */
+static const uint32_t sha256_iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static void sha256_block(void *state, const unsigned char *p) {
+    uint32_t *h = state, w[64];
+    for (int i = 0; i < 16; i++) w[i] = load_be32(p + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
     }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
 
-    // Clean current working directory
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
+static void sha256_init(HashCtx *ctx) {
+    memcpy(ctx->u.sha256.h, sha256_iv, sizeof(sha256_iv));
+    ctx->u.sha256.len = 0;
+    ctx->u.sha256.buf_len = 0;
+}
 
-    if ((dir = opendir(".")) != NULL) {
-        while ((entry = readdir(dir)) != NULL) {
-            if (entry->d_name[0] == '.') continue;
-            if (stat(entry->d_name, &file_stat) == -1) continue;
+static void sha256_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    Sha256Ctx *c = &ctx->u.sha256;
+    md_update(c->buf, &c->buf_len, &c->len, data, len, sha256_block, c->h);
+}
+
+static void sha256_final(HashCtx *ctx, char *hex) {
+    Sha256Ctx *c = &ctx->u.sha256;
+    md_pad(c->buf, c->buf_len, c->len, sha256_block, c->h);
+    hex_words(c->h, 8, 0, hex);
+}
+
+/* BLAKE3, portable single-threaded version of the reference implementation */
+enum { B3_CHUNK_START = 1, B3_CHUNK_END = 2, B3_PARENT = 4, B3_ROOT = 8 };
+
+static void b3_g(uint32_t *s, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void b3_compress(const uint32_t cv[8], const unsigned char block[64], uint64_t counter,
+                        uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    static const int perm[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+    uint32_t m[16], t[16], s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                                    sha256_iv[0], sha256_iv[1], sha256_iv[2], sha256_iv[3],
+                                    (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags};
+    for (int i = 0; i < 16; i++) m[i] = load_le32(block + 4 * i);
+    for (int r = 0; r < 7; r++) {
+        b3_g(s, 0, 4, 8, 12, m[0], m[1]);
+        b3_g(s, 1, 5, 9, 13, m[2], m[3]);
+        b3_g(s, 2, 6, 10, 14, m[4], m[5]);
+        b3_g(s, 3, 7, 11, 15, m[6], m[7]);
+        b3_g(s, 0, 5, 10, 15, m[8], m[9]);
+        b3_g(s, 1, 6, 11, 12, m[10], m[11]);
+        b3_g(s, 2, 7, 8, 13, m[12], m[13]);
+        b3_g(s, 3, 4, 9, 14, m[14], m[15]);
+        for (int i = 0; i < 16; i++) t[i] = m[perm[i]];
+        memcpy(m, t, sizeof(m));
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void b3_parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8]) {
+    unsigned char block[64];
+    uint32_t full[16];
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 4; b++) {
+            block[4 * i + b] = (unsigned char)(left[i] >> (8 * b));
+            block[32 + 4 * i + b] = (unsigned char)(right[i] >> (8 * b));
+        }
+    }
+    b3_compress(sha256_iv, block, 0, 64, B3_PARENT | flags, full);
+    memcpy(out, full, 8 * sizeof(uint32_t));
+}
+
+static void blake3_init(HashCtx *ctx) {
+    Blake3Ctx *c = &ctx->u.blake3;
+    memcpy(c->cv, sha256_iv, sizeof(sha256_iv));
+    c->chunk_counter = 0;
+    c->block_len = 0;
+    c->blocks_compressed = 0;
+    c->cv_stack_len = 0;
+}
+
+static void blake3_update(HashCtx *ctx, const unsigned char *data, size_t len) {
+    Blake3Ctx *c = &ctx->u.blake3;
+    while (len > 0) {
+        // A full chunk is only closed once more input arrives; the last one becomes the root
+        if (c->blocks_compressed * 64 + c->block_len == 1024) {
+            uint32_t full[16], cv[8];
+            b3_compress(c->cv, c->block, c->chunk_counter, 64, B3_CHUNK_END |
+                        (c->blocks_compressed == 0 ? B3_CHUNK_START : 0), full);
+            memcpy(cv, full, sizeof(cv));
+            uint64_t total = ++c->chunk_counter;
+            while ((total & 1) == 0) {
+                b3_parent_cv(c->cv_stack[--c->cv_stack_len], cv, 0, cv);
+                total >>= 1;
+            }
+            memcpy(c->cv_stack[c->cv_stack_len++], cv, sizeof(cv));
+            memcpy(c->cv, sha256_iv, sizeof(sha256_iv));
+            c->block_len = 0;
+            c->blocks_compressed = 0;
+        }
+        if (c->block_len == 64) {
+            uint32_t full[16];
+            b3_compress(c->cv, c->block, c->chunk_counter, 64,
+                        c->blocks_compressed == 0 ? B3_CHUNK_START : 0, full);
+            memcpy(c->cv, full, 8 * sizeof(uint32_t));
+            c->blocks_compressed++;
+            c->block_len = 0;
+        }
+        size_t take = 64 - c->block_len < len ? 64 - c->block_len : len;
+        memcpy(c->block + c->block_len, data, take);
+        c->block_len += take;
+        data += take;
+        len -= take;
+    }
+}
+
+static void blake3_final(HashCtx *ctx, char *hex) {
+    Blake3Ctx *c = &ctx->u.blake3;
+    uint32_t out[16], cv[8];
+    memset(c->block + c->block_len, 0, 64 - c->block_len);
+    uint32_t flags = B3_CHUNK_END | (c->blocks_compressed == 0 ? B3_CHUNK_START : 0);
+    if (c->cv_stack_len == 0) {
+        b3_compress(c->cv, c->block, c->chunk_counter, c->block_len, flags | B3_ROOT, out);
+    } else {
+        b3_compress(c->cv, c->block, c->chunk_counter, c->block_len, flags, out);
+        memcpy(cv, out, sizeof(cv));
+        for (int i = c->cv_stack_len - 1; i > 0; i--) b3_parent_cv(c->cv_stack[i], cv, 0, cv);
+        b3_parent_cv(c->cv_stack[0], cv, B3_ROOT, out);
+    }
+    hex_words(out, 8, 1, hex);
+}
+
+static const HashAlgo hash_algos[] = {
+    {"djb2", 40, djb2_init, djb2_update, djb2_final},
+    {"sha1", 40, sha1_init, sha1_update, sha1_final},
+    {"sha256", 64, sha256_init, sha256_update, sha256_final},
+    {"blake3", 64, blake3_init, blake3_update, blake3_final},
+};
+
+const HashAlgo *find_hash_algo(const char *name) {
+    for (size_t i = 0; i < sizeof(hash_algos) / sizeof(hash_algos[0]); i++) {
+        if (strcmp(hash_algos[i].name, name) == 0) return &hash_algos[i];
+    }
+    return NULL;
+}
+
+void hash_init(HashCtx *ctx, const HashAlgo *algo) {
+    ctx->algo = algo;
+    algo->init(ctx);
+}
+
+void hash_update(HashCtx *ctx, const void *data, size_t len) {
+    ctx->algo->update(ctx, data, len);
+}
+
+void hash_final(HashCtx *ctx, char *hex) {
+    ctx->algo->final(ctx, hex);
+}
+
+/*
+ * I/O policy. Passes over the working tree and the object store read each
+ * file once, front to back; telling the kernel so (and dropping large files
+ * afterwards) keeps status and commit from evicting the page cache that the
+ * user's build depends on. Upcoming files in a work queue are prefetched.
+ */
+enum { IO_ONCE = 0, IO_REUSE = 1 };
+
+static struct {
+    long dontneed_threshold;
+    int readahead_depth;
+    long direct_threshold;
+} io_policy;
+
+static pthread_once_t io_policy_once = PTHREAD_ONCE_INIT;
+
+static void io_policy_load(void) {
+    io_policy.dontneed_threshold = get_config_long("io.dontneedThreshold", 1L << 20);
+    io_policy.readahead_depth = (int)get_config_long("io.readaheadDepth", 8);
+    io_policy.direct_threshold = get_config_long("io.directThreshold", 1L << 30);
+}
+
+/*
+ * Reads the io.* settings once. main calls it as soon as the repository
+ * is found, before any worker thread runs; commands that start outside
+ * one get them on first use, still only once.
+ */
+void io_policy_init(void) {
+    pthread_once(&io_policy_once, io_policy_load);
+}
+
+static long io_dontneed_threshold(void) {
+    io_policy_init();
+    return io_policy.dontneed_threshold;
+}
+
+int io_readahead_depth(void) {
+    io_policy_init();
+    return io_policy.readahead_depth;
+}
+
+void io_sequential(int fd) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    (void)fd;
+#endif
+}
+
+/* Called once a range has been consumed; drops it unless it is needed again */
+void io_done(int fd, off_t offset, off_t len, int reuse) {
+#ifdef POSIX_FADV_DONTNEED
+    if (!reuse && len >= io_dontneed_threshold()) posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#else
+    (void)fd, (void)offset, (void)len, (void)reuse;
+#endif
+}
+
+/* For a file hashed with IO_REUSE whose second read turned out unneeded */
+void io_drop(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0) io_done(fd, 0, st.st_size, IO_ONCE);
+    close(fd);
+}
+
+void io_prefetch_range(int fd, off_t offset, off_t len) {
+#if defined(__linux__)
+    readahead(fd, offset, len);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+    (void)fd, (void)offset, (void)len;
+#endif
+}
+
+void io_prefetch(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) io_prefetch_range(fd, 0, st.st_size);
+    close(fd);
+}
+
+/*
+ * O_DIRECT streaming for files over io.directThreshold (default 1 GiB,
+ * 0 disables). A reader thread fills one aligned buffer while the caller
+ * hashes or writes the other, so bypassing the page cache does not cost
+ * throughput. Filesystems without O_DIRECT fall back to buffered I/O.
+ */
+#define DIRECT_ALIGN 4096
+#define DIRECT_CHUNK (8 << 20)
+
+typedef struct DirectStream {
+    int fd;
+    unsigned char *buf[2];
+    ssize_t len[2];
+    int full[2];
+    int current;
+    int stop;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DirectStream;
+
+long io_direct_threshold(void) {
+    io_policy_init();
+    return io_policy.direct_threshold;
+}
+
+int io_use_direct(off_t size) {
+    long threshold = io_direct_threshold();
+    return threshold > 0 && size >= threshold;
+}
+
+static void *direct_reader(void *p) {
+    DirectStream *ds = p;
+    for (int slot = 1;; slot ^= 1) {
+        pthread_mutex_lock(&ds->lock);
+        while (ds->full[slot] && !ds->stop) pthread_cond_wait(&ds->cond, &ds->lock);
+        int stop = ds->stop;
+        pthread_mutex_unlock(&ds->lock);
+        if (stop) break;
+
+        ssize_t n = read(ds->fd, ds->buf[slot], DIRECT_CHUNK);
+        pthread_mutex_lock(&ds->lock);
+        ds->len[slot] = n;
+        ds->full[slot] = 1;
+        pthread_cond_broadcast(&ds->cond);
+        pthread_mutex_unlock(&ds->lock);
+        if (n <= 0) break;
+    }
+    return NULL;
+}
+
+static void direct_free(DirectStream *ds) {
+    if (ds->fd >= 0) close(ds->fd);
+    free(ds->buf[0]);
+    free(ds->buf[1]);
+}
+
+/* The first chunk is read synchronously so an unsupported filesystem fails here */
+int direct_open(DirectStream *ds, const char *path) {
+    memset(ds, 0, sizeof(*ds));
+    ds->fd = -1;
+#ifdef O_DIRECT
+    ds->fd = open(path, O_RDONLY | O_DIRECT);
+    if (ds->fd < 0) return -1;
+    void *a = NULL, *b = NULL;
+    if (posix_memalign(&a, DIRECT_ALIGN, DIRECT_CHUNK) != 0 || posix_memalign(&b, DIRECT_ALIGN, DIRECT_CHUNK) != 0) {
+        free(a);
+        close(ds->fd);
+        return -1;
+    }
+    ds->buf[0] = a;
+    ds->buf[1] = b;
+    ds->len[0] = read(ds->fd, ds->buf[0], DIRECT_CHUNK);
+    if (ds->len[0] < 0) {
+        direct_free(ds);
+        return -1;
+    }
+    ds->full[0] = 1;
+    ds->current = -1;
+    pthread_mutex_init(&ds->lock, NULL);
+    pthread_cond_init(&ds->cond, NULL);
+    if (ds->len[0] == DIRECT_CHUNK && pthread_create(&ds->reader, NULL, direct_reader, ds) != 0) {
+        pthread_mutex_destroy(&ds->lock);
+        pthread_cond_destroy(&ds->cond);
+        direct_free(ds);
+        return -1;
+    }
+    if (ds->len[0] < DIRECT_CHUNK) ds->len[1] = 0, ds->full[1] = 1;
+    return 0;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+/* Hands out the next filled buffer; it stays valid until the following call */
+ssize_t direct_next(DirectStream *ds, unsigned char **data) {
+    pthread_mutex_lock(&ds->lock);
+    if (ds->current >= 0) {
+        ds->full[ds->current] = 0;
+        pthread_cond_broadcast(&ds->cond);
+    }
+    int slot = ds->current < 0 ? 0 : ds->current ^ 1;
+    while (!ds->full[slot]) pthread_cond_wait(&ds->cond, &ds->lock);
+    ds->current = slot;
+    ssize_t n = ds->len[slot];
+    pthread_mutex_unlock(&ds->lock);
+    *data = ds->buf[slot];
+    return n;
+}
+
+void direct_close(DirectStream *ds) {
+    pthread_mutex_lock(&ds->lock);
+    int threaded = ds->len[0] == DIRECT_CHUNK;
+    ds->stop = 1;
+    pthread_cond_broadcast(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+    if (threaded) pthread_join(ds->reader, NULL);
+    pthread_mutex_destroy(&ds->lock);
+    pthread_cond_destroy(&ds->cond);
+    direct_free(ds);
+}
+
+/*
+ * Streams src to dest (if given) and hashes it (if algo is given), both
+ * without the page cache. The tail is written padded to the block size and
+ * the file truncated back. Returns -1 before producing any output when
+ * O_DIRECT is not available, so callers can retry buffered.
+ */
+int direct_copy(const char *src, const char *dest, const HashAlgo *algo, char *hex) {
+    DirectStream ds;
+    if (direct_open(&ds, src) != 0) return -1;
+    int out = -1, out_direct = 0;
+    if (dest) {
+#ifdef O_DIRECT
+        out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        out_direct = out >= 0;
+#endif
+        if (out < 0) out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            direct_close(&ds);
+            return -1;
+        }
+    }
+
+    HashCtx ctx;
+    if (algo) hash_init(&ctx, algo);
+    unsigned char *data;
+    ssize_t n;
+    off_t total = 0;
+    int rc = 0;
+    while ((n = direct_next(&ds, &data)) > 0) {
+        if (algo) hash_update(&ctx, data, n);
+        if (out >= 0) {
+            size_t len = n;
+            if (out_direct && len % DIRECT_ALIGN) {
+                size_t padded = (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+                memset(data + len, 0, padded - len);
+                len = padded;
+            }
+            if (write(out, data, len) != (ssize_t)len) rc = -1;
+        }
+        total += n;
+    }
+    if (n < 0) rc = -1;
+    direct_close(&ds);
+    if (out >= 0) {
+        if (ftruncate(out, total) != 0) rc = -1;
+        if (close(out) != 0) rc = -1;
+    }
+    if (algo) hash_final(&ctx, hex);
+    return rc;
+}
+
+static const HashAlgo *repo_algo = NULL;
+
+/* Repositories without core.objectFormat predate it and use djb2 */
+const HashAlgo *repo_hash_algo(void) {
+    if (!repo_algo) {
+        char name[32];
+        if (get_config("core.objectFormat", name, sizeof(name))) repo_algo = find_hash_algo(name);
+        if (!repo_algo) repo_algo = find_hash_algo("djb2");
+    }
+    return repo_algo;
+}
+
+/*
+ * reuse is IO_REUSE when the caller reads the file again right after.
+ * Returns -1 when the file cannot be read; output is then all zeros.
+ */
+int hash_file(const char *filename, char *output, int reuse) {
+    const HashAlgo *algo = repo_hash_algo();
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        memset(output, '0', algo->hex_len);
+        output[algo->hex_len] = 0;
+        return -1;
+    }
+    STAT_ADD(files_opened, 1);
+    STAT_ADD(files_hashed, 1);
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && io_use_direct(st.st_size) &&
+        direct_copy(filename, NULL, algo, output) == 0) {
+        STAT_ADD(bytes_hashed, st.st_size);
+        fclose(file);
+        return 0;
+    }
+    io_sequential(fileno(file));
+
+    HashCtx ctx;
+    hash_init(&ctx, algo);
+    unsigned char buf[65536];
+    size_t n;
+    off_t total = 0;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        hash_update(&ctx, buf, n);
+        total += n;
+    }
+    int failed = ferror(file);
+    io_done(fileno(file), 0, total, reuse);
+    fclose(file);
+    hash_final(&ctx, output);
+    STAT_ADD(bytes_hashed, total);
+    if (!failed) return 0;
+    memset(output, '0', algo->hex_len);
+    return -1;
+}
+
+void simple_hash_file(const char *filename, char *output) {
+    hash_file(filename, output, IO_ONCE);
+}
+
+void simple_hash_buffer(const char *data, size_t len, char *output) {
+    HashCtx ctx;
+    hash_init(&ctx, repo_hash_algo());
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, output);
+}
+
+int check_repository_format(void) {
+    if (access(VCS_DIR, F_OK) != 0) return 0;
+    long version = get_config_long("core.formatVersion", 0);
+    if (version > REPO_FORMAT_VERSION) {
+        printf("Repository format version %ld is newer than this vcs supports (%d).\n",
+               version, REPO_FORMAT_VERSION);
+        return -1;
+    }
+    char name[32];
+    if (get_config("core.objectFormat", name, sizeof(name)) && !find_hash_algo(name)) {
+        printf("Unknown object format '%s'.\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Parses one idx line; returns 0 for lines that are not entries */
+static int parse_pack_entry(const char *line, PackedObject *obj) {
+    int n = sscanf(line, "%64s %ld %ld %ld %16s", obj->hash, &obj->offset, &obj->size, &obj->stored, obj->dict);
+    if (n == 5) return 1;
+    if (n != 3) return 0;
+    obj->stored = obj->size;
+    obj->dict[0] = 0;
+    return 1;
+}
+
+void unload_packs(void) {
+    for (int i = 0; i < pack_set.pack_count; i++) free(pack_set.packs[i]);
+    free(pack_set.packs);
+    free(pack_set.objects);
+    for (int i = 0; i < pack_set.alternate_count; i++) {
+        free(pack_set.alternates[i].objects);
+        close(pack_set.alternates[i].fd);
+    }
+    free(pack_set.alternates);
+    memset(&pack_set, 0, sizeof(pack_set));
+}
+
+static int compare_packed_objects(const void *a, const void *b) {
+    return strcmp(((const PackedObject *)a)->hash, ((const PackedObject *)b)->hash);
+}
+
+static void stamp_pack_dir(const char *objects, PackDirStamp *stamp) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/pack", objects);
+    if (stat(path, &st) == 0) stamp->mtime = st.st_mtim;
+    snprintf(path, sizeof(path), "%s/pack/write.idx", objects);
+    stamp->write_idx_size = stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/*
+ * Packs appear and vanish by rename, which touches the directory, and the
+ * write idx only grows. A directory time that is not older than the load
+ * is not trusted, as a change in the same clock tick would leave it equal.
+ */
+static int pack_dir_changed(const char *objects, const PackDirStamp *stamp) {
+    PackDirStamp now = {{0, 0}, -1};
+    stamp_pack_dir(objects, &now);
+    if (now.write_idx_size != stamp->write_idx_size) return 1;
+    if (now.mtime.tv_sec != stamp->mtime.tv_sec || now.mtime.tv_nsec != stamp->mtime.tv_nsec) return 1;
+    return now.mtime.tv_sec > pack_set.loaded_at.tv_sec ||
+           (now.mtime.tv_sec == pack_set.loaded_at.tv_sec && now.mtime.tv_nsec >= pack_set.loaded_at.tv_nsec);
+}
+
+/*
+ * Pack indexes are text: one "<hash> <offset> <size>" line per object, or
+ * "<hash> <offset> <size> <stored> <dict>" when it is compressed.
+ */
+static void load_pack_dir(const char *pack_dir) {
+    DIR *dir = opendir(pack_dir);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0) continue;
+        char idx_path[PATH_MAX], pack_path[PATH_MAX];
+        snprintf(idx_path, sizeof(idx_path), "%s/%s", pack_dir, entry->d_name);
+        snprintf(pack_path, sizeof(pack_path), "%s/%.*s.pack", pack_dir, (int)(len - 4), entry->d_name);
+        FILE *idx = fopen(idx_path, "r");
+        if (!idx) continue;
+
+        int pack = pack_set.pack_count++;
+        pack_set.packs = realloc(pack_set.packs, sizeof(char *) * pack_set.pack_count);
+        pack_set.packs[pack] = strdup(pack_path);
+        char line[256];
+        PackedObject obj;
+        obj.pack = pack;
+        while (fgets(line, sizeof(line), idx)) {
+            // The write idx is appended to; a line without newline is still being written
+            if (!strchr(line, '\n') || !parse_pack_entry(line, &obj)) continue;
+            if (pack_set.count == pack_set.capacity) {
+                pack_set.capacity = pack_set.capacity ? pack_set.capacity * 2 : 1024;
+                pack_set.objects = realloc(pack_set.objects, sizeof(PackedObject) * pack_set.capacity);
+            }
+            pack_set.objects[pack_set.count++] = obj;
+        }
+        fclose(idx);
+    }
+    closedir(dir);
+}
+
+/*
+ * Adds the stores listed in <objects>/info/alternates, one path per line,
+ * absolute or relative to <objects>. Their own alternates are followed
+ * too, up to ALTERNATE_DEPTH; a store already listed is skipped.
+ */
+static void load_alternates(const char *objects, const char *self, int depth) {
+    char path[PATH_MAX], line[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/info/alternates", objects);
+    FILE *f = depth < ALTERNATE_DEPTH ? fopen(path, "r") : NULL;
+    while (f && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0] || line[0] == '#') continue;
+        char joined[PATH_MAX * 2], real[PATH_MAX];
+        if (line[0] == '/') snprintf(joined, sizeof(joined), "%s", line);
+        else snprintf(joined, sizeof(joined), "%s/%s", objects, line);
+        if (!realpath(joined, real) || strcmp(real, self) == 0) continue;
+        int known = 0;
+        for (int i = 0; i < pack_set.alternate_count && !known; i++) {
+            known = strcmp(pack_set.alternates[i].objects, real) == 0;
+        }
+        int fd = known ? -1 : open(real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) continue;
+        pack_set.alternates = realloc(pack_set.alternates, sizeof(Alternate) * (pack_set.alternate_count + 1));
+        Alternate *alt = &pack_set.alternates[pack_set.alternate_count++];
+        alt->objects = strdup(real);
+        alt->fd = fd;
+        stamp_pack_dir(real, &alt->stamp);
+        if (snprintf(path, sizeof(path), "%s/pack", real) < (int)sizeof(path)) load_pack_dir(path);
+        load_alternates(real, self, depth + 1);
+    }
+    if (f) fclose(f);
+}
+
+void load_packs(void) {
+    if (pack_set.loaded) return;
+    pack_set.loaded = 1;
+    STAT_ADD(pack_loads, 1);
+    clock_gettime(CLOCK_REALTIME_COARSE, &pack_set.loaded_at);
+    stamp_pack_dir(OBJECTS_DIR, &pack_set.stamp);
+    load_pack_dir(PACK_DIR);
+    pack_set.local_packs = pack_set.pack_count;
+    char self[PATH_MAX];
+    if (realpath(OBJECTS_DIR, self)) load_alternates(self, self, 0);
+    if (pack_set.count) qsort(pack_set.objects, pack_set.count, sizeof(PackedObject), compare_packed_objects);
+}
+
+/* Whether a reload could find more than the loaded indexes */
+static int packs_changed(void) {
+    if (!pack_set.loaded || pack_dir_changed(OBJECTS_DIR, &pack_set.stamp)) return 1;
+    for (int i = 0; i < pack_set.alternate_count; i++) {
+        if (pack_dir_changed(pack_set.alternates[i].objects, &pack_set.alternates[i].stamp)) return 1;
+    }
+    return 0;
+}
+
+/* Packed objects of alternates are borrowed, not owned */
+static int packed_locally(const PackedObject *obj) {
+    return obj->pack < pack_set.local_packs;
+}
+
+/* Loose objects of the alternates; the caller holds pack_lock */
+static int open_alternate_object(const char *hash) {
+    load_packs();
+    for (int i = 0; i < pack_set.alternate_count; i++) {
+        int fd = openat(pack_set.alternates[i].fd, hash, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) return fd;
+    }
+    return -1;
+}
+
+static int alternate_has_object(const char *hash) {
+    load_packs();
+    for (int i = 0; i < pack_set.alternate_count; i++) {
+        if (faccessat(pack_set.alternates[i].fd, hash, F_OK, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+const PackedObject *find_packed_object(const char *hash) {
+    load_packs();
+    PackedObject key;
+    snprintf(key.hash, sizeof(key.hash), "%s", hash);
+    if (!pack_set.count) return NULL;
+    return bsearch(&key, pack_set.objects, pack_set.count, sizeof(PackedObject), compare_packed_objects);
+}
+
+/* Trained deflate dictionary, loaded once per id and kept for the process */
+typedef struct CompressionDict {
+    char id[DICT_ID_SIZE];
+    char *data;
+    int len;
+    struct CompressionDict *next;
+} CompressionDict;
+
+static CompressionDict *dict_cache = NULL;
+static pthread_mutex_t dict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Ids are content hashes, so a cached dictionary is valid in any repository */
+static const CompressionDict *load_dict(const char *id) {
+    timed_lock(&dict_lock);
+    CompressionDict *dict = dict_cache;
+    while (dict && strcmp(dict->id, id) != 0) dict = dict->next;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", DICT_DIR, id);
+    FILE *f = dict ? NULL : fopen(path, "rb");
+    if (!f && !dict) {
+        // Objects borrowed from an alternate were compressed with its dictionaries
+        timed_lock(&pack_lock);
+        load_packs();
+        for (int i = 0; i < pack_set.alternate_count && !f; i++) {
+            snprintf(path, sizeof(path), "%s/../dict/%s", pack_set.alternates[i].objects, id);
+            f = fopen(path, "rb");
+        }
+        pthread_mutex_unlock(&pack_lock);
+    }
+    if (f) {
+        dict = calloc(1, sizeof(*dict));
+        snprintf(dict->id, sizeof(dict->id), "%s", id);
+        dict->data = malloc(DICT_MAX_SIZE);
+        dict->len = fread(dict->data, 1, DICT_MAX_SIZE, f);
+        fclose(f);
+        dict->next = dict_cache;
+        dict_cache = dict;
+    }
+    pthread_mutex_unlock(&dict_lock);
+    return dict;
+}
+
+/* The dictionary new packs are compressed with, if one has been trained */
+static const CompressionDict *current_dict(void) {
+    char id[DICT_ID_SIZE];
+    if (!get_config("core.compressionDict", id, sizeof(id)) || !id[0]) return NULL;
+    return load_dict(id);
+}
+
+/* Inflates a compressed pack entry into a NUL-terminated buffer */
+static char *inflate_entry(const char *data, const PackedObject *obj) {
+    const CompressionDict *dict = load_dict(obj->dict);
+    if (!dict) return NULL;
+    char *out = malloc(obj->size + 1);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (!out || inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    inflateSetDictionary(&z, (const Bytef *)dict->data, dict->len);
+    z.next_in = (Bytef *)data;
+    z.avail_in = obj->stored;
+    z.next_out = (Bytef *)out;
+    z.avail_out = obj->size;
+    int rc = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (rc != Z_STREAM_END || z.total_out != (uLong)obj->size) {
+        free(out);
+        return NULL;
+    }
+    out[obj->size] = 0;
+    return out;
+}
+
+/* Reads one pack entry into memory, inflating it if it is compressed */
+static char *read_packed_entry(const char *pack, const PackedObject *obj) {
+    int fd = open(pack, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    char *data = malloc(obj->stored + 1);
+    ssize_t n = data ? pread(fd, data, obj->stored, obj->offset) : -1;
+    close(fd);
+    if (n != obj->stored) {
+        free(data);
+        return NULL;
+    }
+    if (!obj->dict[0]) {
+        data[n] = 0;
+        return data;
+    }
+    char *content = inflate_entry(data, obj);
+    free(data);
+    return content;
+}
+
+/* Read-only FILE over a heap buffer, which is freed on fclose() */
+typedef struct MemoryStream {
+    char *data;
+    long size;
+    long pos;
+} MemoryStream;
+
+static ssize_t memory_read(void *cookie, char *buf, size_t size) {
+    MemoryStream *m = cookie;
+    size_t left = m->size - m->pos;
+    if (size > left) size = left;
+    memcpy(buf, m->data + m->pos, size);
+    m->pos += size;
+    return size;
+}
+
+static int memory_seek(void *cookie, off64_t *offset, int whence) {
+    MemoryStream *m = cookie;
+    off64_t pos = whence == SEEK_SET ? *offset : whence == SEEK_CUR ? m->pos + *offset : m->size + *offset;
+    if (pos < 0 || pos > m->size) return -1;
+    *offset = m->pos = pos;
+    return 0;
+}
+
+static int memory_close(void *cookie) {
+    MemoryStream *m = cookie;
+    free(m->data);
+    free(m);
+    return 0;
+}
+
+static FILE *memory_stream(char *data, long size) {
+    MemoryStream *m = malloc(sizeof(MemoryStream));
+    cookie_io_functions_t io = {.read = memory_read, .seek = memory_seek, .close = memory_close};
+    FILE *f = m ? fopencookie(m, "rb", io) : NULL;
+    if (!f) {
+        free(m);
+        free(data);
+        return NULL;
+    }
+    m->data = data;
+    m->size = size;
+    m->pos = 0;
+    return f;
+}
+
+/* Deflate state reused across the objects of one pack writer */
+typedef struct DictCompressor {
+    z_stream z;
+    const CompressionDict *dict;
+    unsigned char *out;
+    int ready;
+} DictCompressor;
+
+/* A NULL dict compresses without one, which train-dict uses as a baseline */
+static void compressor_init(DictCompressor *c, const CompressionDict *dict, int level) {
+    memset(c, 0, sizeof(*c));
+    c->dict = dict;
+    c->out = malloc(DICT_OBJECT_MAX);
+    c->ready = c->out && deflateInit2(&c->z, level, Z_DEFLATED, -MAX_WBITS, 8,
+                                      Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+/* Compresses into c->out; returns the length, or -1 when raw is no larger */
+static long compress_object(DictCompressor *c, const char *data, long size) {
+    if (!c->ready || size <= 0 || size > DICT_OBJECT_MAX) return -1;
+    deflateReset(&c->z);
+    if (c->dict) deflateSetDictionary(&c->z, (const Bytef *)c->dict->data, c->dict->len);
+    c->z.next_in = (Bytef *)data;
+    c->z.avail_in = size;
+    c->z.next_out = c->out;
+    c->z.avail_out = size - 1;
+    if (deflate(&c->z, Z_FINISH) != Z_STREAM_END) return -1;
+    return (long)c->z.total_out;
+}
+
+static void compressor_end(DictCompressor *c) {
+    if (c->ready) deflateEnd(&c->z);
+    free(c->out);
+}
+
+/* Appends an object as given: stored bytes of packed against dict_id, or raw when stored < 0 */
+static long pack_append_entry(FILE *pack, const char *hash, const char *data, long size, const void *packed,
+                              long stored, const char *dict_id, long offset, ExtSorter *entries) {
+    char entry[HASH_SIZE + 96];
+    if (stored >= 0) {
+        fwrite(packed, 1, stored, pack);
+        snprintf(entry, sizeof(entry), "%s %ld %ld %ld %s", hash, offset, size, stored, dict_id);
+    } else {
+        stored = fwrite(data, 1, size, pack);
+        snprintf(entry, sizeof(entry), "%s %ld %ld", hash, offset, stored);
+    }
+    extsort_add(entries, entry);
+    return stored;
+}
+
+/* Appends an in-memory object to a pack, compressed when a dictionary is set */
+static long pack_append(FILE *pack, DictCompressor *c, const char *hash, const char *data, long size,
+                        long offset, ExtSorter *entries) {
+    long stored = c->dict ? compress_object(c, data, size) : -1;
+    return pack_append_entry(pack, hash, data, size, c->out, stored, stored >= 0 ? c->dict->id : NULL, offset,
+                             entries);
+}
+
+/*
+ * Opens an object wherever it lives, here or in an alternate. The stream
+ * is positioned at the start of the content and *size bytes belong to it.
+ * A miss reloads the pack indexes once if they changed, since maintenance
+ * may have packed or repacked meanwhile. Compressed pack entries come
+ * back as memory streams, where fileno() is -1.
+ */
+FILE *open_object(const char *hash, long *size) {
+    int fd = openat(objects_dir_fd(), hash, O_RDONLY | O_CLOEXEC);
+    FILE *f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    if (f) {
+        struct stat st;
+        fstat(fileno(f), &st);
+        *size = st.st_size;
+        STAT_ADD(loose_hits, 1);
+        return f;
+    }
+    timed_lock(&pack_lock);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt && !packs_changed()) break;
+        if (attempt) unload_packs();
+        const PackedObject *obj = find_packed_object(hash);
+        if (!obj) {
+            fd = open_alternate_object(hash);
+            f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+            if (!f) continue;
+            pthread_mutex_unlock(&pack_lock);
+            struct stat st;
+            fstat(fileno(f), &st);
+            *size = st.st_size;
+            STAT_ADD(loose_hits, 1);
+            return f;
+        }
+        if (obj->dict[0]) {
+            // Compressed entries are inflated whole; they are small by construction
+            PackedObject entry = *obj;
+            char pack[PATH_MAX];
+            snprintf(pack, sizeof(pack), "%s", pack_set.packs[obj->pack]);
+            pthread_mutex_unlock(&pack_lock);
+            char *data = read_packed_entry(pack, &entry);
+            f = data ? memory_stream(data, entry.size) : NULL;
+            if (!f) {
+                STAT_ADD(object_misses, 1);
+                return NULL;
+            }
+            *size = entry.size;
+            STAT_ADD(pack_hits, 1);
+            return f;
+        }
+        f = fopen(pack_set.packs[obj->pack], "rb");
+        if (f && fseek(f, obj->offset, SEEK_SET) == 0) {
+            *size = obj->size;
+            pthread_mutex_unlock(&pack_lock);
+            STAT_ADD(pack_hits, 1);
+            return f;
+        }
+        if (f) fclose(f);
+    }
+    pthread_mutex_unlock(&pack_lock);
+    STAT_ADD(object_misses, 1);
+    return NULL;
+}
+
+int object_exists(const char *hash) {
+    if (faccessat(objects_dir_fd(), hash, F_OK, 0) == 0) {
+        STAT_ADD(loose_hits, 1);
+        return 1;
+    }
+    timed_lock(&pack_lock);
+    int found = find_packed_object(hash) != NULL || alternate_has_object(hash);
+    if (!found && packs_changed()) {
+        unload_packs();
+        found = find_packed_object(hash) != NULL || alternate_has_object(hash);
+    }
+    pthread_mutex_unlock(&pack_lock);
+    if (found) STAT_ADD(pack_hits, 1);
+    else STAT_ADD(object_misses, 1);
+    return found;
+}
+
+void io_prefetch_object(const char *hash) {
+    char path[MAX_PATH_LEN];
+    object_path(hash, path);
+    if (access(path, F_OK) == 0) {
+        io_prefetch(path);
+        return;
+    }
+    timed_lock(&pack_lock);
+    const PackedObject *obj = find_packed_object(hash);
+    int fd = obj ? open(pack_set.packs[obj->pack], O_RDONLY) : -1;
+    if (fd >= 0) {
+        io_prefetch_range(fd, obj->offset, obj->stored);
+        close(fd);
+    }
+    pthread_mutex_unlock(&pack_lock);
+}
+
+/* Loads a whole object into memory, NUL-terminated for text parsing */
+char *read_object(const char *hash, long *size) {
+    FILE *f = open_object(hash, size);
+    if (!f) return NULL;
+    char *buf = malloc(*size + 1);
+    if (buf && fread(buf, 1, *size, f) != (size_t)*size) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf) buf[*size] = 0;
+    fclose(f);
+    return buf;
+}
+
+/* Unique per process and thread; maintenance skips names containing '.' */
+void tmp_object_path(const char *path, char *tmp) {
+    long seq = __sync_fetch_and_add(&tmp_sequence, 1);
+    if (snprintf(tmp, MAX_PATH_LEN, "%s.tmp%d-%ld", path, (int)getpid(), seq) >= MAX_PATH_LEN) tmp[0] = 0;
+}
+
+/*
+ * Append-only pack that commit writes small objects into instead of one
+ * loose file each. Objects are appended during the session and their idx
+ * lines only at the end, after the pack is synced, so no reader sees an
+ * entry before its bytes. One writer at a time holds a flock on the pack;
+ * readers need none. Once it outgrows core.writePackSize the pack is
+ * sealed under a regular name and a new one is started.
+ */
+typedef struct WritePack {
+    FILE *pack;
+    long offset;
+    long max_object;
+    ExtSorter entries;
+    StrMap pending;  // appended this session, not yet in the idx
+    DictCompressor compressor;
+    pthread_mutex_t lock;
+} WritePack;
+
+static WritePack write_pack = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Gives the full write pack a regular name; the caller holds its lock */
+static void seal_write_pack(void) {
+    char pack[MAX_PATH_LEN], idx[MAX_PATH_LEN];
+    long now = time(NULL);
+    snprintf(pack, sizeof(pack), "%s/pack-%ld-%d-w.pack", PACK_DIR, now, (int)getpid());
+    snprintf(idx, sizeof(idx), "%s/pack-%ld-%d-w.idx", PACK_DIR, now, (int)getpid());
+    if (link(WRITE_PACK, pack) != 0) return;
+    if (rename(WRITE_PACK_IDX, idx) != 0 && errno != ENOENT) {
+        remove(pack);
+        return;
+    }
+    remove(WRITE_PACK);
+}
+
+void write_pack_begin(void) {
+    long threshold = get_config_long("core.writePackThreshold", 65536);
+    long limit = get_config_long("core.writePackSize", 64L * 1024 * 1024);
+    if (threshold <= 0 || write_pack.pack) return;
+    mkdir(PACK_DIR, 0755);
+    for (;;) {
+        FILE *pack = fopen(WRITE_PACK, "ab");
+        if (!pack) return;
+        flock(fileno(pack), LOCK_EX);
+        // Another writer may have sealed the file between open and lock
+        struct stat st, current;
+        fstat(fileno(pack), &st);
+        if (stat(WRITE_PACK, &current) != 0 || current.st_ino != st.st_ino) {
+            fclose(pack);
+            continue;
+        }
+        if (st.st_size >= limit) {
+            seal_write_pack();
+            fclose(pack);
+            continue;
+        }
+        write_pack.pack = pack;
+        write_pack.offset = st.st_size;
+        break;
+    }
+    write_pack.max_object = threshold;
+    extsort_init(&write_pack.entries, 1);
+    memset(&write_pack.pending, 0, sizeof(write_pack.pending));
+    compressor_init(&write_pack.compressor, current_dict(), Z_BEST_SPEED);
+}
+
+/*
+ * A compressor for one thread of the write pack session, so objects can be
+ * compressed before write_pack_add takes the lock. Not ready when the
+ * session has no dictionary.
+ */
+void write_pack_compressor(DictCompressor *c) {
+    if (write_pack.pack && write_pack.compressor.dict) compressor_init(c, write_pack.compressor.dict, Z_BEST_SPEED);
+    else memset(c, 0, sizeof(*c));
+}
+
+/* Compressed form of an object headed for the write pack, or NULL to store it as it is */
+char *write_pack_compress(DictCompressor *c, const char *data, size_t len, long *stored) {
+    if (!c->ready || (long)len > write_pack.max_object) return NULL;
+    *stored = compress_object(c, data, len);
+    if (*stored < 0) return NULL;
+    char *packed = malloc(*stored);
+    if (packed) memcpy(packed, c->out, *stored);
+    return packed;
+}
+
+/* packed comes from write_pack_compress; without it the shared compressor runs under the lock */
+static int write_pack_add(const char *hash, const char *data, size_t len, const char *packed, long stored) {
+    timed_lock(&write_pack.lock);
+    if (strmap_put(&write_pack.pending, hash, NULL)) {
+        write_pack.offset +=
+            packed ? pack_append_entry(write_pack.pack, hash, data, len, packed, stored,
+                                       write_pack.compressor.dict->id, write_pack.offset, &write_pack.entries)
+                   : pack_append(write_pack.pack, &write_pack.compressor, hash, data, len, write_pack.offset,
+                                 &write_pack.entries);
+        STAT_ADD(objects_written, 1);
+    }
+    int failed = ferror(write_pack.pack);
+    pthread_mutex_unlock(&write_pack.lock);
+    return failed ? -1 : 0;
+}
+
+/* Syncs the appended objects, then publishes their idx lines in one append */
+int write_pack_end(void) {
+    if (!write_pack.pack) return 0;
+    int failed = fflush(write_pack.pack) != 0 || fsync(fileno(write_pack.pack)) != 0;
+    extsort_finish(&write_pack.entries);
+    if (!failed && write_pack.pending.count) {
+        int fd = open(WRITE_PACK_IDX, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        FILE *idx = fd >= 0 ? fdopen(fd, "a") : NULL;
+        struct stat st;
+        char last = '\n';
+        // A torn line from a crashed writer must not swallow the first new one
+        if (idx && fstat(fd, &st) == 0 && st.st_size > 0) {
+            int in = open(WRITE_PACK_IDX, O_RDONLY);
+            if (in < 0 || pread(in, &last, 1, st.st_size - 1) != 1) last = 0;
+            if (in >= 0) close(in);
+        }
+        if (idx && last != '\n') fputc('\n', idx);
+        const char *line;
+        while (idx && (line = extsort_next(&write_pack.entries)) != NULL) fprintf(idx, "%s\n", line);
+        if (!idx || fflush(idx) != 0 || fsync(fd) != 0) failed = 1;
+        if (idx) fclose(idx);
+        else if (fd >= 0) close(fd);
+    }
+    extsort_free(&write_pack.entries);
+    strmap_free(&write_pack.pending);
+    compressor_end(&write_pack.compressor);
+    fclose(write_pack.pack);
+    write_pack.pack = NULL;
+    unload_packs();
+    return failed ? -1 : 0;
+}
+
+/*
+ * Objects are published with rename() so readers never see partial
+ * content. During a write pack session small ones are appended there,
+ * as packed when the caller compressed them with write_pack_compress.
+ */
+int store_packed_object(const char *hash, const char *data, size_t len, const char *packed, long stored) {
+    if (object_exists(hash)) return 0;
+    if (write_pack.pack && (long)len <= write_pack.max_object) return write_pack_add(hash, data, len, packed, stored);
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    object_path(hash, path);
+    tmp_object_path(path, tmp);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    fwrite(data, 1, len, f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    STAT_ADD(objects_written, 1);
+    return 0;
+}
+
+int store_object(const char *hash, const char *data, size_t len) {
+    return store_packed_object(hash, data, len, NULL, -1);
+}
+
+void copy_file(const char *src, const char *dest) {
+    FILE *fsrc = fopen(src, "rb");
+    FILE *fdest = fopen(dest, "wb");
+    if (!fsrc || !fdest) {
+        if (fsrc) fclose(fsrc);
+        if (fdest) fclose(fdest);
+        return;
+    }
+    char buf[1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fsrc)) > 0) {
+        fwrite(buf, 1, n, fdest);
+    }
+    fclose(fsrc);
+    fclose(fdest);
+}
+
+void init_repo() {
+    if (mkdir(VCS_DIR, 0755) == 0) {
+        mkdir(OBJECTS_DIR, 0755);
+        mkdir(BRANCHES_DIR, 0755);
+        mkdir(BRANCH_HEADS, 0755);
+
+        FILE *f = fopen(INDEX_FILE, "w");
+        if (f) fclose(f);
+        f = fopen(CONFIG_FILE, "w");
+        if (f) {
+            fprintf(f, "core.formatVersion = %d\n", REPO_FORMAT_VERSION);
+            fprintf(f, "core.objectFormat = %s\n", DEFAULT_OBJECT_FORMAT);
+            fclose(f);
+        }
+        set_current_branch("master");
+
+        char log_path[MAX_PATH_LEN];
+        get_branch_log_path(log_path);
+        f = fopen(log_path, "w");
+        if (f) fclose(f);
+
+        snprintf(log_path, MAX_PATH_LEN, "%s/master.txt", BRANCH_HEADS);
+        f = fopen(log_path, "w");
+        if (f) fclose(f);
+
+        printf("Repository initialized with master branch.\n");
+    } else {
+        printf("Repository already exists.\n");
+    }
+}
+
+void add_file(const char *filename) {
+    FILE *index = fopen(INDEX_FILE, "a");
+    if (!index) return;
+    flock(fileno(index), LOCK_EX);  // index compaction rewrites in place
+    fprintf(index, "%s\n", filename);
+    fclose(index);
+    printf("Added '%s' to staging.\n", filename);
+}
+
+/* Returns 0 once the object exists, -1 when it could not be stored */
+int write_object(const char *filename, const char *hash) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    object_path(hash, path);
+    if (object_exists(hash)) return 0;
+    tmp_object_path(path, tmp);
+
+    struct stat st;
+    if (stat(filename, &st) == 0 && io_use_direct(st.st_size)) {
+        if (direct_copy(filename, tmp, NULL, NULL) == 0 && rename(tmp, path) == 0) {
+            STAT_ADD(objects_written, 1);
+            return 0;
+        }
+        remove(tmp);
+    }
+
+    FILE *src = fopen(filename, "rb");
+    if (src) STAT_ADD(files_opened, 1);
+    FILE *dest = fopen(tmp, "wb");
+    if (!src || !dest) {
+        if (src) fclose(src);
+        if (dest) fclose(dest);
+        return -1;
+    }
+
+    io_sequential(fileno(src));
+    char buffer[65536];
+    size_t n;
+    off_t total = 0;
+    int failed = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+        if (fwrite(buffer, 1, n, dest) != n) failed = 1;
+        total += n;
+    }
+    if (ferror(src)) failed = 1;
+
+    io_done(fileno(src), 0, total, IO_ONCE);
+    fclose(src);
+    if (fclose(dest) != 0 || failed || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    STAT_ADD(objects_written, 1);
+    return 0;
+}
+
+/* Hashes and stores a large file in one direct pass instead of reading it twice */
+int store_file_direct(const char *filename, char *hash) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    object_path("direct", path);
+    tmp_object_path(path, tmp);
+    if (direct_copy(filename, tmp, repo_hash_algo(), hash) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    object_path(hash, path);
+    STAT_ADD(files_opened, 1);
+    STAT_ADD(files_hashed, 1);
+    if (object_exists(hash) || rename(tmp, path) != 0) remove(tmp);
+    else STAT_ADD(objects_written, 1);
+    return 0;
+}
+
+void tree_add(Tree *tree, const char *path, const char *hash) {
+    if (tree->count == tree->capacity) {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 64;
+        tree->entries = realloc(tree->entries, sizeof(TreeEntry) * tree->capacity);
+    }
+    TreeEntry *e = &tree->entries[tree->count];
+    e->path = strdup(path);
+    strncpy(e->hash, hash, HASH_SIZE - 1);
+    e->hash[HASH_SIZE - 1] = 0;
+    e->order = tree->count++;
+}
+
+void free_tree(Tree *tree) {
+    for (int i = 0; i < tree->count; i++) free(tree->entries[i].path);
+    free(tree->entries);
+    tree->entries = NULL;
+    tree->count = tree->capacity = 0;
+}
+
+static int compare_tree_entries(const void *a, const void *b) {
+    const TreeEntry *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    if (c) return c;
+    return x->order - y->order;
+}
+
+/* Sorts by path and keeps only the last entry recorded for each path */
+void tree_finalize(Tree *tree) {
+    if (tree->count == 0) return;
+    qsort(tree->entries, tree->count, sizeof(TreeEntry), compare_tree_entries);
+    int out = 0;
+    for (int i = 0; i < tree->count; i++) {
+        if (i + 1 < tree->count && strcmp(tree->entries[i].path, tree->entries[i + 1].path) == 0) {
+            free(tree->entries[i].path);
+            continue;
+        }
+        tree->entries[out] = tree->entries[i];
+        tree->entries[out].order = out;
+        out++;
+    }
+    tree->count = out;
+}
+
+/* Index of the first entry whose path is >= key */
+int tree_lower_bound(const Tree *tree, const char *key) {
+    int lo = 0, hi = tree->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(tree->entries[mid].path, key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+TreeEntry *tree_find(const Tree *tree, const char *path) {
+    int i = tree_lower_bound(tree, path);
+    if (i < tree->count && strcmp(tree->entries[i].path, path) == 0) return &tree->entries[i];
+    return NULL;
+}
+
+/* Folds "- <file> : <hash>" lines (branch heads or logs) into a tree */
+static void read_manifest(FILE *f, Tree *tree) {
+    char line[512], filename[MAX_PATH_LEN], hash[HASH_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "- ", 2) == 0 && sscanf(line, "- %255s : %64s", filename, hash) == 2) {
+            tree_add(tree, filename, hash);
+        }
+    }
+}
+
+void load_manifest(const char *manifest_path, Tree *tree) {
+    FILE *f = fopen(manifest_path, "r");
+    if (!f) return;
+    read_manifest(f, tree);
+    fclose(f);
+    tree_finalize(tree);
+}
+
+/* Stores a tree object: one "<hash> <path>" line per entry */
+void write_tree(const Tree *tree, char *tree_hash) {
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap);
+    for (int i = 0; i < tree->count; i++) {
+        size_t need = strlen(tree->entries[i].hash) + strlen(tree->entries[i].path) + 3;
+        while (len + need >= cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        len += sprintf(buf + len, "%s %s\n", tree->entries[i].hash, tree->entries[i].path);
+    }
+    simple_hash_buffer(buf, len, tree_hash);
+    store_object(tree_hash, buf, len);
+    free(buf);
+}
+
+int read_tree(const char *tree_hash, Tree *tree) {
+    long size;
+    char *data = read_object(tree_hash, &size);
+    if (!data) return -1;
+    char hash[HASH_SIZE], filename[MAX_PATH_LEN];
+    for (char *line = strtok(data, "\n"); line; line = strtok(NULL, "\n")) {
+        if (sscanf(line, "%64s %255s", hash, filename) == 2) tree_add(tree, filename, hash);
+    }
+    free(data);
+    tree_finalize(tree);
+    return 0;
+}
+
+/*
+ * Resolves a branch name or commit id (prefix) to its snapshot. Commits
+ * recorded before tree objects existed are rebuilt from the branch log.
+ */
+int load_commit_tree(const char *rev, Tree *tree) {
+    char path[sizeof(BRANCHES_DIR) + MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.txt", BRANCH_HEADS, rev);
+    if (access(path, F_OK) == 0) {
+        load_manifest(path, tree);
+        return 0;
+    }
+
+    DIR *dir = opendir(BRANCHES_DIR);
+    if (!dir) return -1;
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (!strstr(entry->d_name, ".log")) continue;
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        FILE *log = fopen(path, "r");
+        if (!log) continue;
+
+        char line[512], id[64], filename[MAX_PATH_LEN], hash[HASH_SIZE];
+        int inside = 0;
+        while (fgets(line, sizeof(line), log)) {
+            if (strncmp(line, "commit ", 7) == 0) {
+                if (inside) break;
+                sscanf(line, "commit %63s", id);
+                inside = strncmp(id, rev, strlen(rev)) == 0;
+            } else if (inside && strncmp(line, "tree ", 5) == 0) {
+                sscanf(line, "tree %64s", hash);
+                free_tree(tree);
+                read_tree(hash, tree);
+                found = 1;
+                break;
+            } else if (strncmp(line, "- ", 2) == 0 && sscanf(line, "- %255s : %64s", filename, hash) == 2) {
+                tree_add(tree, filename, hash);
+            }
+        }
+        fclose(log);
+        if (inside && !found) {
+            tree_finalize(tree);
+            found = 1;
+        } else if (!found) {
+            free_tree(tree);
+        }
+    }
+    closedir(dir);
+    return found ? 0 : -1;
+}
+
+/*
+ * Partial clones leave blobs behind in the source repository (the promisor).
+ * Missing objects are requested in one batch from a child process that runs
+ * inside the promisor and streams "<hash> <size>\n<bytes>" frames over a pipe.
+ */
+static void serve_objects(FILE *in, FILE *out) {
+    char line[128];
+    char **wanted = NULL;
+    int count = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\n")] = 0;
+        wanted = realloc(wanted, sizeof(char *) * (count + 1));
+        wanted[count++] = strdup(line);
+    }
+    for (int i = 0; i < count; i++) {
+        long size;
+        FILE *obj = open_object(wanted[i], &size);
+        if (!obj) {
+            fprintf(out, "%s missing\n", wanted[i]);
+        } else {
+            fprintf(out, "%s %ld\n", wanted[i], size);
+            char buf[8192];
+            size_t n;
+            while (size > 0 && (n = fread(buf, 1, size < (long)sizeof(buf) ? (size_t)size : sizeof(buf), obj)) > 0) {
+                fwrite(buf, 1, n, out);
+                size -= n;
+            }
+            fclose(obj);
+        }
+        free(wanted[i]);
+    }
+    free(wanted);
+    fflush(out);
+}
+
+int fetch_missing_objects(char **hashes, int count) {
+    char promisor[PATH_MAX];
+    FILE *f = fopen(PROMISOR_FILE, "r");
+    if (!f) return 0;
+    if (!fgets(promisor, sizeof(promisor), f)) promisor[0] = 0;
+    fclose(f);
+    promisor[strcspn(promisor, "\n")] = 0;
+
+    char path[MAX_PATH_LEN];
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        if (!object_exists(hashes[i])) missing++;
+    }
+    if (missing == 0) return 0;
+
+    int req[2], resp[2];
+    if (pipe(req) != 0) return -1;
+    if (pipe(resp) != 0) {
+        close(req[0]);
+        close(req[1]);
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(req[0]);
+        close(req[1]);
+        close(resp[0]);
+        close(resp[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(req[1]);
+        close(resp[0]);
+        FILE *in = fdopen(req[0], "r");
+        FILE *out = fdopen(resp[1], "w");
+        unload_packs();
+        forget_repository();
+        if (chdir(promisor) == 0) serve_objects(in, out);
+        fclose(in);
+        fclose(out);
+        _exit(0);
+    }
+    close(req[0]);
+    close(resp[1]);
+
+    FILE *out = fdopen(req[1], "w");
+    for (int i = 0; i < count; i++) {
+        if (!object_exists(hashes[i])) fprintf(out, "%s\n", hashes[i]);
+    }
+    fclose(out);
+
+    FILE *in = fdopen(resp[0], "r");
+    char line[128], hash[HASH_SIZE], tmp[MAX_PATH_LEN];
+    long size;
+    int fetched = 0;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%64s %ld", hash, &size) != 2) continue;
+        object_path(hash, path);
+        tmp_object_path(path, tmp);
+        FILE *obj = fopen(tmp, "wb");
+        char buf[8192];
+        while (size > 0) {
+            size_t n = fread(buf, 1, size < (long)sizeof(buf) ? (size_t)size : sizeof(buf), in);
+            if (n == 0) break;
+            if (obj) fwrite(buf, 1, n, obj);
+            size -= n;
+        }
+        if (obj) {
+            fclose(obj);
+            if (size == 0 && rename(tmp, path) == 0) fetched++;
+            else remove(tmp);
+        }
+    }
+    fclose(in);
+    waitpid(pid, NULL, 0);
+    STAT_ADD(objects_fetched, fetched);
+    return fetched == missing ? 0 : -1;
+}
+
+int fetch_tree_objects(const Tree *tree) {
+    char **hashes = malloc(sizeof(char *) * (tree->count + 1));
+    for (int i = 0; i < tree->count; i++) hashes[i] = tree->entries[i].hash;
+    int rc = fetch_missing_objects(hashes, tree->count);
+    free(hashes);
+    return rc;
+}
+
+void make_parent_dirs(const char *filename) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", filename);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+/* Writes an object's content to a working tree file, fetching it if needed */
+int restore_object(const char *hash, const char *filename) {
+    char obj_path[MAX_PATH_LEN];
+    struct stat st;
+    object_path(hash, obj_path);
+    if (stat(obj_path, &st) == 0 && io_use_direct(st.st_size)) {
+        make_parent_dirs(filename);
+        if (direct_copy(obj_path, filename, NULL, NULL) == 0) return 0;
+    }
+
+    long size;
+    FILE *src = open_object(hash, &size);
+    if (!src) {
+        char *one = (char *)hash;
+        fetch_missing_objects(&one, 1);
+        src = open_object(hash, &size);
+    }
+    if (!src) {
+        printf(COLOR_RED "Object %s for '%s' is missing.\n" COLOR_RESET, hash, filename);
+        return -1;
+    }
+    make_parent_dirs(filename);
+    FILE *dest = fopen(filename, "wb");
+    if (dest) {
+        STAT_ADD(files_opened, 1);
+        long base = ftell(src), total = size;
+        io_sequential(fileno(src));
+        char buf[65536];
+        size_t n;
+        while (size > 0 && (n = fread(buf, 1, size < (long)sizeof(buf) ? (size_t)size : sizeof(buf), src)) > 0) {
+            fwrite(buf, 1, n, dest);
+            size -= n;
+        }
+        io_done(fileno(src), base, total, IO_ONCE);
+        fclose(dest);
+    }
+    fclose(src);
+    return dest ? 0 : -1;
+}
+
+/* Materializes entries in order, prefetching the objects a few entries ahead */
+void restore_tree(const Tree *tree) {
+    int depth = io_readahead_depth();
+    for (int i = 0; i < depth && i < tree->count; i++) io_prefetch_object(tree->entries[i].hash);
+    for (int i = 0; i < tree->count; i++) {
+        if (i + depth < tree->count) io_prefetch_object(tree->entries[i + depth].hash);
+        restore_object(tree->entries[i].hash, tree->entries[i].path);
+    }
+}
+
+CommitNode *create_commit_node(const char *id, const char *message, CommitNode *parent) {
+    CommitNode *node = (CommitNode *)malloc(sizeof(CommitNode));
+    strcpy(node->id, id);
+    strcpy(node->message, message);
+    node->parent = parent;
+    node->children = NULL;
+    node->child_count = 0;
+    if (parent) {
+        parent->children = realloc(parent->children, sizeof(CommitNode *) * (parent->child_count + 1));
+        parent->children[parent->child_count++] = node;
+    }
+    return node;
+}
+
+/*
+ * Hooks live in .myvcs/hooks as <name> and/or any executables in <name>.d/.
+ * Every hook gets the changed paths NUL-delimited on stdin, so its cost
+ * follows the size of the change. Up to hooks.jobs hooks run at once; the
+ * first failure kills the rest.
+ */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int list_hooks(const char *name, char ***hooks) {
+    char path[MAX_PATH_LEN];
+    int count = 0;
+    *hooks = NULL;
+    snprintf(path, sizeof(path), "%s/%s", HOOKS_DIR, name);
+    if (access(path, X_OK) == 0) {
+        *hooks = malloc(sizeof(char *));
+        (*hooks)[count++] = strdup(path);
+    }
+    snprintf(path, sizeof(path), "%s/%s.d", HOOKS_DIR, name);
+    DIR *dir = opendir(path);
+    if (!dir) return count;
+    struct dirent *entry;
+    int first = count;
+    while ((entry = readdir(dir)) != NULL) {
+        char hook[sizeof(path) + MAX_PATH_LEN];
+        if (entry->d_name[0] == '.') continue;
+        snprintf(hook, sizeof(hook), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(hook, &st) != 0 || !S_ISREG(st.st_mode) || access(hook, X_OK) != 0) continue;
+        *hooks = realloc(*hooks, sizeof(char *) * (count + 1));
+        (*hooks)[count++] = strdup(hook);
+    }
+    closedir(dir);
+    qsort(*hooks + first, count - first, sizeof(char *), compare_names);
+    return count;
+}
+
+static volatile sig_atomic_t hooks_interrupted = 0;
+
+static void interrupt_hooks(int sig) {
+    (void)sig;
+    hooks_interrupted = 1;
+}
+
+/*
+ * Each hook leads its own process group so cancelling reaches its
+ * children. Both sides set it, so the group exists before fork returns to
+ * run_hooks and a kill(-pid) can never run ahead of the child.
+ */
+static pid_t spawn_hook(const char *hook, const char *input, char *const args[]) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid > 0) setpgid(pid, pid);
+    if (pid != 0) return pid;
+    setpgid(0, 0);
+    int fd = open(input, O_RDONLY);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    char *argv[4] = {(char *)hook, NULL, NULL, NULL};
+    for (int i = 0; i < 2 && args && args[i]; i++) argv[i + 1] = args[i];
+    execv(hook, argv);
+    perror(hook);
+    _exit(127);
+}
+
+/* Runs every hook for name; returns 0 when all of them succeed */
+int run_hooks(const char *name, char *const *files, int file_count, char *const args[]) {
+    char **hooks;
+    int count = list_hooks(name, &hooks);
+    if (count == 0) return 0;
+
+    char input[MAX_PATH_LEN];
+    mkdir(TMP_DIR, 0755);
+    snprintf(input, sizeof(input), "%s/hook-XXXXXX", TMP_DIR);
+    int fd = mkstemp(input);
+    FILE *list = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!list) {
+        printf(COLOR_RED "Cannot write the file list for %s hooks.\n" COLOR_RESET, name);
+        for (int i = 0; i < count; i++) free(hooks[i]);
+        free(hooks);
+        return -1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        fputs(files[i], list);
+        fputc(0, list);
+    }
+    fclose(list);
+
+    int jobs = (int)get_config_long("hooks.jobs", default_jobs());
+    if (jobs < 1) jobs = 1;
+    // Ctrl-C no longer reaches the hooks directly; forward it as a cancel
+    struct sigaction cancel = {0}, old_int, old_term;
+    cancel.sa_handler = interrupt_hooks;
+    sigaction(SIGINT, &cancel, &old_int);
+    sigaction(SIGTERM, &cancel, &old_term);
+    hooks_interrupted = 0;
+
+    pid_t *running = calloc(count, sizeof(pid_t));
+    int started = 0, active = 0, status = 0;
+    while (started < count || active > 0) {
+        while (!status && started < count && active < jobs) {
+            running[started] = spawn_hook(hooks[started], input, args);
+            if (running[started] > 0) active++;
+            else status = -1;
+            started++;
+        }
+        if (active == 0) break;
+
+        int wstatus;
+        pid_t done = wait(&wstatus);
+        if (done < 0 && errno != EINTR) break;
+        if (hooks_interrupted && !status) {
+            printf(COLOR_RED "Interrupted; cancelling %s hooks.\n" COLOR_RESET, name);
+            status = -1;
+        }
+        for (int i = 0; done > 0 && i < started; i++) {
+            if (running[i] != done) continue;
+            running[i] = 0;
+            active--;
+            if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+                if (!status) printf(COLOR_RED "Hook %s failed.\n" COLOR_RESET, hooks[i]);
+                status = -1;
+            }
+        }
+        // Cancel whatever is still running once one hook has failed
+        if (status) {
+            for (int i = 0; i < started; i++) {
+                if (running[i] > 0) kill(-running[i], SIGTERM);
+            }
+            started = count;
+        }
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    free(running);
+    unlink(input);
+    for (int i = 0; i < count; i++) free(hooks[i]);
+    free(hooks);
+    return status;
+}
+
+/* pre-commit sees the staged paths; commit-msg may rewrite the message */
+static int run_commit_hooks(const char *message, char *edited, size_t size) {
+    snprintf(edited, size, "%s", message);
+    char **files = NULL;
+    int count = 0;
+    char filename[MAX_PATH_LEN];
+    FILE *index = fopen(INDEX_FILE, "r");
+    while (index && fgets(filename, sizeof(filename), index)) {
+        filename[strcspn(filename, "\n")] = 0;
+        files = realloc(files, sizeof(char *) * (count + 1));
+        files[count++] = strdup(filename);
+    }
+    if (index) fclose(index);
+
+    int status = run_hooks("pre-commit", files, count, NULL);
+    if (status == 0) {
+        FILE *msg = fopen(COMMIT_MSG_FILE, "w");
+        if (msg) {
+            fprintf(msg, "%s\n", message);
+            fclose(msg);
+        }
+        char *args[] = {COMMIT_MSG_FILE, NULL};
+        status = run_hooks("commit-msg", files, count, args);
+        msg = fopen(COMMIT_MSG_FILE, "r");
+        if (msg && fgets(edited, size, msg)) edited[strcspn(edited, "\n")] = 0;
+        if (msg) fclose(msg);
+        remove(COMMIT_MSG_FILE);
+    }
+    for (int i = 0; i < count; i++) free(files[i]);
+    free(files);
+    return status;
+}
+
+#define PIPELINE_QUEUE 64
+#define PIPELINE_MAX_INLINE (8L * 1024 * 1024)  // larger files keep the streaming path
+#define PIPELINE_MAX_BYTES (64L * 1024 * 1024)  // file data in flight, unless the memory limit is lower
+
+/* Bounded FIFO between pipeline stages; closes when its last producer finishes */
+typedef struct WorkQueue {
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} WorkQueue;
+
+static void queue_init(WorkQueue *q, int capacity, int producers) {
+    q->items = malloc(sizeof(void *) * capacity);
+    q->capacity = capacity;
+    q->head = q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+static void queue_push(WorkQueue *q, void *item) {
+    timed_lock(&q->lock);
+    while (q->count == q->capacity) pthread_cond_wait(&q->changed, &q->lock);
+    q->items[(q->head + q->count++) % q->capacity] = item;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Blocks for the next item; NULL once every producer is done and the queue is drained */
+static void *queue_pop(WorkQueue *q) {
+    timed_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) pthread_cond_wait(&q->changed, &q->lock);
+    void *item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static void queue_done(WorkQueue *q) {
+    timed_lock(&q->lock);
+    q->producers--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_free(WorkQueue *q) {
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+}
+
+/* One staged file on its way through the commit pipeline */
+typedef struct CommitItem {
+    int seq;
+    const char *path;
+    char *data;  // whole content; NULL for files that take the streaming path
+    size_t len;
+    size_t reserved;  // bytes of the budget held for data
+    char *packed;  // compressed for the write pack by the hasher, or NULL
+    long stored;
+    int failed;  // its object could not be stored
+    char hash[HASH_SIZE];
+} CommitItem;
+
+typedef struct CommitPipeline {
+    char **staged;
+    int count;
+    WorkQueue to_hash;
+    WorkQueue to_write;
+    WorkQueue done;
+    size_t in_flight;  // bytes read but not yet written
+    size_t max_bytes;
+    pthread_mutex_t budget_lock;
+    pthread_cond_t budget_freed;
+} CommitPipeline;
+
+static void release_budget(CommitPipeline *p, CommitItem *item) {
+    pthread_mutex_lock(&p->budget_lock);
+    p->in_flight -= item->reserved;
+    pthread_cond_broadcast(&p->budget_freed);
+    pthread_mutex_unlock(&p->budget_lock);
+    item->reserved = 0;
+}
+
+static CommitItem *read_item(CommitPipeline *p, int i) {
+    CommitItem *item = calloc(1, sizeof(CommitItem));
+    item->seq = i;
+    item->path = p->staged[i];
+    struct stat st;
+    STAT_ADD(files_stat, 1);
+    int fd = stat(item->path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= PIPELINE_MAX_INLINE &&
+             !io_use_direct(st.st_size) ? open(item->path, O_RDONLY) : -1;
+    if (fd >= 0) {
+        pthread_mutex_lock(&p->budget_lock);
+        while (p->in_flight > 0 && p->in_flight + st.st_size > p->max_bytes) {
+            pthread_cond_wait(&p->budget_freed, &p->budget_lock);
+        }
+        p->in_flight += st.st_size;
+        pthread_mutex_unlock(&p->budget_lock);
+        item->reserved = st.st_size;
+
+        STAT_ADD(files_opened, 1);
+        item->data = malloc(st.st_size + 1);
+        ssize_t n;  // one byte more than stat saw, to notice a file that grew
+        while (item->len <= (size_t)st.st_size &&
+               (n = read(fd, item->data + item->len, st.st_size + 1 - item->len)) > 0) {
+            item->len += n;
+        }
+        io_done(fd, 0, item->len, IO_ONCE);
+        close(fd);
+        if (item->len != (size_t)st.st_size) {
+            // Changed while being read: the streaming path hashes what is there now
+            free(item->data);
+            item->data = NULL;
+            item->len = 0;
+            release_budget(p, item);
+        }
+    }
+    return item;
+}
+
+/* Hashes (and compresses) loaded content; returns 1 when the item still has to be written */
+static int hash_item(CommitItem *item, const HashAlgo *algo, DictCompressor *c) {
+    if (!item->data) {
+        struct stat st;
+        if (stat(item->path, &st) != 0 || !io_use_direct(st.st_size) ||
+            store_file_direct(item->path, item->hash) != 0) {
+            // write_object reads it again
+            if (hash_file(item->path, item->hash, IO_REUSE) != 0) item->failed = 1;
+            else if (object_exists(item->hash)) io_drop(item->path);
+            else if (write_object(item->path, item->hash) != 0) item->failed = 1;
+        }
+        return 0;
+    }
+    HashCtx ctx;
+    hash_init(&ctx, algo);
+    hash_update(&ctx, item->data, item->len);
+    hash_final(&ctx, item->hash);
+    STAT_ADD(files_hashed, 1);
+    STAT_ADD(bytes_hashed, item->len);
+    if (!object_exists(item->hash)) item->packed = write_pack_compress(c, item->data, item->len, &item->stored);
+    return 1;
+}
+
+static void write_item(CommitPipeline *p, CommitItem *item) {
+    if (store_packed_object(item->hash, item->data, item->len, item->packed, item->stored) != 0) item->failed = 1;
+    free(item->data);
+    free(item->packed);
+    item->data = item->packed = NULL;
+    release_budget(p, item);
+}
+
+/* Reader: loads staged files in order, with readahead, within the byte budget */
+static void *commit_reader(void *arg) {
+    CommitPipeline *p = arg;
+    int depth = io_readahead_depth();
+    for (int i = 0; i < depth && i < p->count; i++) io_prefetch(p->staged[i]);
+    for (int i = 0; i < p->count; i++) {
+        if (i + depth < p->count) io_prefetch(p->staged[i + depth]);
+        queue_push(&p->to_hash, read_item(p, i));
+    }
+    queue_done(&p->to_hash);
+    return NULL;
+}
+
+/* Hasher: hashes and compresses loaded content; files it cannot hold in memory are stored the old way */
+static void *commit_hasher(void *arg) {
+    CommitPipeline *p = arg;
+    const HashAlgo *algo = repo_hash_algo();
+    DictCompressor compressor;
+    write_pack_compressor(&compressor);
+    CommitItem *item;
+    while ((item = queue_pop(&p->to_hash)) != NULL) {
+        queue_push(hash_item(item, algo, &compressor) ? &p->to_write : &p->done, item);
+    }
+    compressor_end(&compressor);
+    queue_done(&p->to_write);
+    queue_done(&p->done);
+    return NULL;
+}
+
+/* Writer: stores new objects from memory and returns their bytes to the budget */
+static void *commit_writer(void *arg) {
+    CommitPipeline *p = arg;
+    CommitItem *item;
+    while ((item = queue_pop(&p->to_write)) != NULL) {
+        write_item(p, item);
+        queue_push(&p->done, item);
+    }
+    queue_done(&p->done);
+    return NULL;
+}
+
+/*
+ * Hashes and stores the staged files through a pipeline of bounded
+ * queues: one reader, core.threads hashers and one writer run at once, so
+ * disk reads, hashing with compression and object writes overlap and the
+ * slowest stage sets the pace. Completed files arrive in any order; emit is called for
+ * them in staging order as soon as each prefix is complete. The stages
+ * start from the writer back, so if a thread cannot be created before any
+ * file is read, the files go through every stage on this thread instead.
+ * Returns the number of files whose objects could not be stored.
+ */
+int commit_pipeline(char **staged, int count, void (*emit)(void *arg, const char *path, const char *hash),
+                    void *arg) {
+    CommitPipeline p = {0};
+    p.staged = staged;
+    p.count = count;
+    int hashers = default_jobs();
+    size_t limit = get_memory_limit();
+    p.max_bytes = limit && limit / 2 < PIPELINE_MAX_BYTES ? limit / 2 : PIPELINE_MAX_BYTES;
+    queue_init(&p.to_hash, PIPELINE_QUEUE, 1);
+    queue_init(&p.to_write, PIPELINE_QUEUE, hashers);
+    queue_init(&p.done, PIPELINE_QUEUE, hashers + 1);
+    pthread_mutex_init(&p.budget_lock, NULL);
+    pthread_cond_init(&p.budget_freed, NULL);
+
+    pthread_t reader, writer, *hasher_threads = malloc(sizeof(pthread_t) * hashers);
+    int started = 0, threaded = pthread_create(&writer, NULL, commit_writer, &p) == 0;
+    while (threaded && started < hashers &&
+           pthread_create(&hasher_threads[started], NULL, commit_hasher, &p) == 0) {
+        started++;
+    }
+    for (int t = started; threaded && t < hashers; t++) {
+        queue_done(&p.to_write);
+        queue_done(&p.done);
+    }
+    if (threaded && (started == 0 || pthread_create(&reader, NULL, commit_reader, &p) != 0)) {
+        queue_done(&p.to_hash);  // nothing was read, so the started stages just wind down
+        for (int t = 0; t < started; t++) pthread_join(hasher_threads[t], NULL);
+        pthread_join(writer, NULL);
+        threaded = 0;
+    }
+
+    CommitItem **finished = calloc(count ? count : 1, sizeof(CommitItem *));
+    int next = 0, failed = 0;
+    CommitItem *item;
+    DictCompressor compressor;
+    if (!threaded) write_pack_compressor(&compressor);
+    for (int i = 0; i < count || threaded; i++) {
+        if (threaded) {
+            if ((item = queue_pop(&p.done)) == NULL) break;
+        } else {
+            item = read_item(&p, i);
+            if (hash_item(item, repo_hash_algo(), &compressor)) write_item(&p, item);
+        }
+        finished[item->seq] = item;
+        for (; next < count && finished[next]; next++) {
+            if (finished[next]->failed) {
+                printf(COLOR_RED "Cannot store '%s'.\n" COLOR_RESET, finished[next]->path);
+                failed++;
+            } else {
+                emit(arg, finished[next]->path, finished[next]->hash);
+            }
+            free(finished[next]);
+        }
+    }
+
+    if (threaded) {
+        pthread_join(reader, NULL);
+        for (int t = 0; t < started; t++) pthread_join(hasher_threads[t], NULL);
+        pthread_join(writer, NULL);
+    } else {
+        compressor_end(&compressor);
+    }
+    free(hasher_threads);
+    free(finished);
+    queue_free(&p.to_hash);
+    queue_free(&p.to_write);
+    queue_free(&p.done);
+    pthread_mutex_destroy(&p.budget_lock);
+    pthread_cond_destroy(&p.budget_freed);
+    return failed;
+}
+
+static void log_committed_file(void *arg, const char *path, const char *hash) {
+    fprintf(arg, "- %s : %s\n", path, hash);
+}
+
+static void append_spilled(FILE *spill, FILE *out) {
+    char buf[65536];
+    size_t n;
+    rewind(spill);
+    while ((n = fread(buf, 1, sizeof(buf), spill)) > 0) fwrite(buf, 1, n, out);
+}
+
+void commit(const char *message, int verify) {
+    char edited[256];
+    if (verify) {
+        if (run_commit_hooks(message, edited, sizeof(edited)) != 0) {
+            printf(COLOR_RED "Commit aborted by hook.\n" COLOR_RESET);
+            return;
+        }
+        message = edited;
+    }
+
+    char commit_id[64];
+    time_t now = time(NULL);
+    snprintf(commit_id, sizeof(commit_id), "%ld", now);
+
+    FILE *index = fopen(INDEX_FILE, "r");
+    if (!index) return;
+
+    char filename[MAX_PATH_LEN];
+    char **staged = NULL;
+    int staged_count = 0;
+    while (fgets(filename, sizeof(filename), index)) {
+        filename[strcspn(filename, "\n")] = 0;
+        staged = realloc(staged, sizeof(char *) * (staged_count + 1));
+        staged[staged_count++] = strdup(filename);
+    }
+    fclose(index);
+
+    // File lines wait here so a failed commit leaves the log and head untouched
+    FILE *files = spill_file();
+    int failed = -1;
+    if (files) {
+        write_pack_begin();
+        failed = commit_pipeline(staged, staged_count, log_committed_file, files);
+        if (failed) write_pack_end();
+    }
+    for (int i = 0; i < staged_count; i++) free(staged[i]);
+    free(staged);
+    if (failed) {
+        if (failed > 0) printf(COLOR_RED "Commit aborted: %d file(s) could not be stored.\n" COLOR_RESET, failed);
+        else printf(COLOR_RED "Commit aborted: cannot create a temporary file.\n" COLOR_RESET);
+        if (files) fclose(files);
+        return;
+    }
+
+    char branch[MAX_PATH_LEN];
+    get_current_branch(branch);
+    char head_file[sizeof(BRANCH_HEADS) + MAX_PATH_LEN + sizeof(".txt")];
+    snprintf(head_file, sizeof(head_file), "%s/%s.txt", BRANCH_HEADS, branch);
+
+    // Snapshot the whole branch so the commit can be read without replaying logs
+    Tree tree = {0};
+    char tree_hash[HASH_SIZE];
+    FILE *head = fopen(head_file, "r");
+    if (head) {
+        read_manifest(head, &tree);
+        fclose(head);
+    }
+    rewind(files);
+    read_manifest(files, &tree);
+    tree_finalize(&tree);
+    write_tree(&tree, tree_hash);
+    free_tree(&tree);
+    // The head and log only name the commit once every object in it is readable
+    if (write_pack_end() != 0) {
+        printf(COLOR_RED "Commit aborted: failed to write the object pack.\n" COLOR_RESET);
+        fclose(files);
+        return;
+    }
+
+    head = fopen(head_file, "a");
+    if (head) {
+        append_spilled(files, head);
+        fclose(head);
+    }
+    char log_path[MAX_PATH_LEN];
+    get_branch_log_path(log_path);
+    FILE *log = fopen(log_path, "a");
+    if (log) {
+        fprintf(log, "commit %s\nmessage: %s\nfiles:\n", commit_id, message);
+        append_spilled(files, log);
+        fprintf(log, "tree %s\n\n", tree_hash);
+        fclose(log);
+    }
+    fclose(files);
+
+    FILE *commit_file = fopen(COMMIT_FILE, "w");
+    if (commit_file) {
+        fprintf(commit_file, "%s", commit_id);
+        fclose(commit_file);
+    }
+
+    index = fopen(INDEX_FILE, "w");
+    if (index) fclose(index);
+
+    // Add to commit tree
+    CommitNode *new_node = create_commit_node(commit_id, message, commit_tree_root);
+    if (commit_tree_root) add_commit_edge(commit_tree_root->id, commit_id);
+    commit_tree_root = new_node;
+
+    printf(COLOR_GREEN "Committed as %s\n" COLOR_RESET, commit_id);
+}
+
+#define OUTPUT_FLUSH_MS 50
+
+/*
+ * Called after each complete record of a streaming command (status lines,
+ * log entries, diff files). The first record is flushed at once and later
+ * ones at most every OUTPUT_FLUSH_MS, so a reader on a pipe sees results
+ * while the command runs without paying one write per line. A record held
+ * back by that limit stays pending; the scan loops call output_poll
+ * between records so it still goes out on time when no record follows.
+ */
+static long output_last_flush = 0;
+static int output_pending = 0;
+
+static void output_poll(void) {
+    if (!output_pending) return;
+    long now = monotonic_ns();
+    if (output_last_flush && now - output_last_flush < OUTPUT_FLUSH_MS * 1000000L) return;
+    if (!output_last_flush) stats.first_output_ns = now;
+    fflush(stdout);
+    output_last_flush = now;
+    output_pending = 0;
+}
+
+static void output_record(void) {
+    output_pending = 1;
+    output_poll();
+}
+
+/*
+ * Compares the working directory with the branch log. Both sides are
+ * sorted through the memory budget and merge-joined, so neither the log
+ * nor the directory listing has to fit in memory.
+ */
+void show_status() {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat file_stat;
+
+    if ((dir = opendir(".")) == NULL) {
+        perror("opendir");
+        return;
+    }
+
+    printf("Changes in working directory:\n");
+    int changes = 0;
+
+    ExtSorter tracked, present;
+    extsort_init(&tracked, 2);
+    extsort_init(&present, 2);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        
+        STAT_ADD(files_stat, 1);
+        if (stat(entry->d_name, &file_stat) == -1) continue;
+        if (S_ISDIR(file_stat.st_mode)) continue;
+
+        if (strcmp(entry->d_name, "vcs") == 0 || strncmp(entry->d_name, ".myvcs", 6) == 0) continue;
+
+        extsort_add(&present, entry->d_name);
+    }
+    closedir(dir);
+
+    char log_path[MAX_PATH_LEN];
+    get_branch_log_path(log_path);
+    FILE *log = fopen(log_path, "r");
+    char line[512], name[MAX_PATH_LEN], hash[HASH_SIZE];
+    long seq = 0;
+    while (log && fgets(line, sizeof(line), log)) {
+        if (sscanf(line, "- %255s : %64s", name, hash) == 2) manifest_sort_add(&tracked, name, hash, seq++);
+    }
+    if (log) fclose(log);
+    extsort_finish(&tracked);
+    extsort_finish(&present);
+
+    // Upcoming names sit in a small ring so they can be prefetched while hashing
+    int depth = io_readahead_depth();
+    int slots = depth + 1, head = 0, filled = 0;
+    char (*ring)[MAX_PATH_LEN] = malloc(sizeof(*ring) * slots);
+    const char *next;
+    while (filled < slots && (next = extsort_next(&present)) != NULL) {
+        snprintf(ring[(head + filled++) % slots], MAX_PATH_LEN, "%s", next);
+        io_prefetch(next);
+    }
+
+    char tracked_path[MAX_PATH_LEN] = "", tracked_hash[HASH_SIZE] = "";
+    int have_tracked = manifest_sort_next(&tracked, tracked_path, tracked_hash);
+    while (filled > 0) {
+        output_poll();
+        const char *file = ring[head];
+        while (have_tracked && strcmp(tracked_path, file) < 0) {
+            have_tracked = manifest_sort_next(&tracked, tracked_path, tracked_hash);
+        }
+
+        if (!have_tracked || strcmp(tracked_path, file) != 0) {
+            printf(COLOR_YELLOW "  new file: %s\n" COLOR_RESET, file);
+            output_record();
+            changes++;
+        } else {
+            simple_hash_file(file, hash);
+            if (strcmp(hash, tracked_hash) != 0) {
+                printf(COLOR_RED "  modified: %s\n" COLOR_RESET, file);
+                output_record();
+                changes++;
+            }
+        }
+
+        head = (head + 1) % slots;
+        filled--;
+        if ((next = extsort_next(&present)) != NULL) {
+            snprintf(ring[(head + filled++) % slots], MAX_PATH_LEN, "%s", next);
+            io_prefetch(next);
+        }
+    }
+    free(ring);
+    extsort_free(&tracked);
+    extsort_free(&present);
+
+    if (changes == 0) {
+        printf("  (no changes detected)\n");
+    }
+}
+
+void show_log() {
+    char log_path[MAX_PATH_LEN];
+    get_branch_log_path(log_path);
+    FILE *log = fopen(log_path, "r");
+    if (!log) return;
+    char line[256];
+    while (fgets(line, sizeof(line), log)) {
+        printf("%s", line);
+        if (line[0] == '\n') output_record();  // entries end with a blank line
+        else output_poll();
+    }
+    fclose(log);
+}
+
+void create_branch(const char *branch_name) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.log", BRANCHES_DIR, branch_name);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Failed to create branch.\n");
+        return;
+    }
+    fclose(f);
+
+    // Copy HEAD from current branch
+    char current[MAX_PATH_LEN];
+    get_current_branch(current);
+    char from[MAX_PATH_LEN], to[MAX_PATH_LEN];
+    snprintf(from, MAX_PATH_LEN, "%s/%s.txt", BRANCH_HEADS, current);
+    snprintf(to, MAX_PATH_LEN, "%s/%s.txt", BRANCH_HEADS, branch_name);
+    copy_file(from, to);
+
+    printf("Branch '%s' created.\n", branch_name);
+}
+
+void checkout_branch(const char *branch_name) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.txt", BRANCH_HEADS, branch_name);
+    if (access(path, F_OK) != 0) {
+        printf("Branch '%s' does not exist.\n", branch_name);
+        return;
+    }
+
+    char previous[MAX_PATH_LEN], previous_path[sizeof(BRANCH_HEADS) + MAX_PATH_LEN + sizeof(".txt")];
+    Tree old_tree = {0};
+    get_current_branch(previous);
+    snprintf(previous_path, sizeof(previous_path), "%s/%s.txt", BRANCH_HEADS, previous);
+    load_manifest(previous_path, &old_tree);
+
+    // Clean current working directory
+    DIR *dir;
+    struct dirent *entry;
+    struct stat file_stat;
+
+    if ((dir = opendir(".")) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            STAT_ADD(files_stat, 1);
+            if (stat(entry->d_name, &file_stat) == -1) continue;
             if (!S_ISDIR(file_stat.st_mode) && 
                 strcmp(entry->d_name, "vcs") != 0 && 
                 strncmp(entry->d_name, ".myvcs", 6) != 0) {
                 remove(entry->d_name);
             }
         }
-        closedir(dir);
+        closedir(dir);
+    }
+
+    Tree tree = {0};
+    load_manifest(path, &tree);
+    fetch_tree_objects(&tree);
+    restore_tree(&tree);
+
+    set_current_branch(branch_name);
+
+    printf("Switched to branch '%s'\n", branch_name);
+
+    // post-checkout only hears about paths that differ between the branches
+    char **changed = malloc(sizeof(char *) * (old_tree.count + tree.count + 1));
+    int count = 0, i = 0, j = 0;
+    while (i < old_tree.count || j < tree.count) {
+        int cmp = i == old_tree.count ? 1 : j == tree.count ? -1 : strcmp(old_tree.entries[i].path, tree.entries[j].path);
+        if (cmp < 0) {
+            changed[count++] = old_tree.entries[i++].path;
+        } else if (cmp > 0) {
+            changed[count++] = tree.entries[j++].path;
+        } else {
+            if (strcmp(old_tree.entries[i].hash, tree.entries[j].hash) != 0) changed[count++] = tree.entries[j].path;
+            i++;
+            j++;
+        }
+    }
+    char *args[] = {previous, (char *)branch_name, NULL};
+    run_hooks("post-checkout", changed, count, args);
+    free(changed);
+    free_tree(&old_tree);
+    free_tree(&tree);
+}
+
+void vcs_revert(const char *commit_id) {
+    char branch[MAX_PATH_LEN];
+    get_current_branch(branch);
+
+    char log_path[MAX_PATH_LEN];
+    snprintf(log_path, sizeof(log_path), "%s/%s.log", BRANCHES_DIR, branch);
+
+    FILE *log = fopen(log_path, "r");
+    if (!log) {
+        printf("Failed to open branch log.\n");
+        return;
+    }
+
+    char line[512];
+    int found = 0;
+
+    while (fgets(line, sizeof(line), log)) {
+        if (strncmp(line, "commit", 6) == 0) {
+            char id[64];
+            sscanf(line, "commit %s", id);
+            if (strncmp(id, commit_id, strlen(commit_id)) == 0) {
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    if (!found) {
+        printf("Commit ID not found.\n");
+        fclose(log);
+        return;
+    }
+
+    fseek(log, 0, SEEK_SET);
+    int inside_target = 0;
+    FILE *index = fopen(INDEX_FILE, "w");
+    if (!index) {
+        printf("Failed to open index.\n");
+        fclose(log);
+        return;
+    }
+
+    Tree restored = {0};
+    while (fgets(line, sizeof(line), log)) {
+        if (strncmp(line, "commit", 6) == 0) {
+            char id[64];
+            sscanf(line, "commit %s", id);
+            if (strncmp(id, commit_id, strlen(commit_id)) == 0) {
+                inside_target = 1;
+                continue;
+            } else if (inside_target) {
+                break;
+            }
+        }
+
+        if (inside_target && strncmp(line, "- ", 2) == 0) {
+            fputs(line, index);
+            char filename[MAX_PATH_LEN], hash[HASH_SIZE];
+            sscanf(line, "- %s : %s", filename, hash);
+            tree_add(&restored, filename, hash);
+        }
+    }
+
+    fetch_tree_objects(&restored);
+    restore_tree(&restored);
+    free_tree(&restored);
+
+    fclose(index);
+    fclose(log);
+
+    system("./vcs commit -m \"Revert commit\"");
+}
+
+void vcs_merge(const char *branch_to_merge) {
+    char current_branch[MAX_PATH_LEN];
+    get_current_branch(current_branch);
+
+    if (strcmp(current_branch, branch_to_merge) == 0) {
+        printf("Cannot merge a branch with itself.\n");
+        return;
+    }
+
+    char current_log_path[MAX_PATH_LEN], merge_log_path[MAX_PATH_LEN];
+    snprintf(current_log_path, sizeof(current_log_path), "%s/%s.log", BRANCHES_DIR, current_branch);
+    snprintf(merge_log_path, sizeof(merge_log_path), "%s/%s.log", BRANCHES_DIR, branch_to_merge);
+
+    FILE *merge_log = fopen(merge_log_path, "r");
+    if (!merge_log) {
+        printf("Branch '%s' not found.\n", branch_to_merge);
+        return;
+    }
+
+    FILE *index = fopen(INDEX_FILE, "a");
+    if (!index) {
+        printf("Failed to open index for merging.\n");
+        fclose(merge_log);
+        return;
+    }
+
+    // Latest version of each path, sorted within the memory budget
+    char line[512];
+    int inside_commit = 0;
+    long seq = 0;
+    ExtSorter entries;
+    extsort_init(&entries, 1);
+    while (fgets(line, sizeof(line), merge_log)) {
+        if (strncmp(line, "commit", 6) == 0) {
+            inside_commit = 1;
+        } else if (inside_commit && strncmp(line, "- ", 2) == 0) {
+            char filename[MAX_PATH_LEN], hash[HASH_SIZE];
+            if (sscanf(line, "- %255s : %64s", filename, hash) == 2) {
+                manifest_sort_add(&entries, filename, hash, seq++);
+            }
+        }
+    }
+    extsort_finish(&entries);
+
+    // Materialize in bounded batches so promisor fetches stay batched too
+    Tree batch = {0};
+    char filename[MAX_PATH_LEN] = "", hash[HASH_SIZE];
+    int more = 1;
+    while (more) {
+        more = manifest_sort_next(&entries, filename, hash);
+        if (more) {
+            tree_add(&batch, filename, hash);
+            fprintf(index, "- %s : %s\n", filename, hash);
+        }
+        if (batch.count == 1024 || (!more && batch.count)) {
+            fetch_tree_objects(&batch);
+            restore_tree(&batch);
+            free_tree(&batch);
+        }
+    }
+    extsort_free(&entries);
+
+    fclose(index);
+    fclose(merge_log);
+
+    printf("Merged changes from branch '%s'. Please commit the merge.\n", branch_to_merge);
+}
+
+/*
+ * Line diffs. Every line carries a 64-bit hash so the diff and the hunk
+ * matcher compare integers and only touch the bytes on a hash match.
+ */
+typedef struct Line {
+    const char *text;
+    size_t len;        // includes the trailing newline, if any
+    uint64_t hash;
+} Line;
+
+typedef struct LineFile {
+    char *data;
+    size_t size;
+    Line *lines;
+    int count;
+    int binary;
+} LineFile;
+
+/* Edit script entry; a and b are the line positions on each side */
+typedef struct DiffOp {
+    char type;         // ' ', '-' or '+'
+    int a;
+    int b;
+} DiffOp;
+
+#define DIFF_CONTEXT 3
+#define DIFF_MAX_EDIT 2048
+
+static uint64_t line_hash(const char *text, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void add_line(LineFile *f, int *capacity, const char *text, size_t len) {
+    if (f->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        f->lines = realloc(f->lines, sizeof(Line) * *capacity);
+    }
+    Line *l = &f->lines[f->count++];
+    l->text = text;
+    l->len = len;
+    l->hash = line_hash(text, len);
+}
+
+/* Takes ownership of data */
+void split_lines(LineFile *f, char *data, size_t size) {
+    int capacity = 0;
+    memset(f, 0, sizeof(*f));
+    f->data = data;
+    f->size = size;
+    if (!data) return;
+    f->binary = memchr(data, 0, size < 8000 ? size : 8000) != NULL;
+    size_t start = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '\n') {
+            add_line(f, &capacity, data + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+    if (start < size) add_line(f, &capacity, data + start, size - start);
+}
+
+void free_lines(LineFile *f) {
+    free(f->data);
+    free(f->lines);
+    memset(f, 0, sizeof(*f));
+}
+
+/* An empty hash yields an empty file; missing blobs are fetched first */
+int load_object_lines(const char *hash, LineFile *f) {
+    long size = 0;
+    char *data = NULL;
+    if (hash && hash[0]) {
+        data = read_object(hash, &size);
+        if (!data) {
+            char *one = (char *)hash;
+            fetch_missing_objects(&one, 1);
+            data = read_object(hash, &size);
+        }
+        if (!data) return -1;
+    }
+    split_lines(f, data, size);
+    return 0;
+}
+
+int load_file_lines(const char *path, LineFile *f) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+    STAT_ADD(files_opened, 1);
+    struct stat st;
+    fstat(fileno(file), &st);
+    io_sequential(fileno(file));
+    char *data = malloc(st.st_size + 1);
+    size_t size = fread(data, 1, st.st_size, file);
+    io_done(fileno(file), 0, st.st_size, IO_ONCE);
+    fclose(file);
+    split_lines(f, data, size);
+    return 0;
+}
+
+static int lines_equal(const Line *x, const Line *y) {
+    return x->hash == y->hash && x->len == y->len && memcmp(x->text, y->text, x->len) == 0;
+}
+
+/*
+ * Myers' O(ND) diff over a[0..n) and b[0..m), marking changed lines.
+ * Keeping the search trace costs O(D^2), so past DIFF_MAX_EDIT edits the
+ * whole range is reported as replaced instead.
+ */
+static void myers_diff(const Line *a, int n, const Line *b, int m, char *a_changed, char *b_changed) {
+    int limit = n + m < DIFF_MAX_EDIT ? n + m : DIFF_MAX_EDIT;
+    int off = limit + 1, found = -1;
+    int *v = calloc(2 * limit + 3, sizeof(int));
+    int **trace = malloc(sizeof(int *) * (limit + 1));
+    int d;
+    for (d = 0; d <= limit && found < 0; d++) {
+        // V as it was before step d, covering diagonals -d-1..d+1
+        trace[d] = malloc(sizeof(int) * (2 * d + 3));
+        memcpy(trace[d], v + off - d - 1, sizeof(int) * (2 * d + 3));
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) ? v[off + k + 1] : v[off + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && lines_equal(&a[x], &b[y])) {
+                x++;
+                y++;
+            }
+            v[off + k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+    }
+    int traced = d;
+
+    if (found < 0) {
+        memset(a_changed, 1, n);
+        memset(b_changed, 1, m);
+    } else {
+        int x = n, y = m;
+        for (d = found; d > 0; d--) {
+            const int *t = trace[d] + d + 1;  // t[k] for k in -d-1..d+1
+            int k = x - y;
+            int prev_k = (k == -d || (k != d && t[k - 1] < t[k + 1])) ? k + 1 : k - 1;
+            int prev_x = t[prev_k], prev_y = prev_x - prev_k;
+            while (x > prev_x && y > prev_y) {
+                x--;
+                y--;
+            }
+            if (x == prev_x) b_changed[prev_y] = 1;
+            else a_changed[prev_x] = 1;
+            x = prev_x;
+            y = prev_y;
+        }
+    }
+    for (d = 0; d < traced; d++) free(trace[d]);
+    free(trace);
+    free(v);
+}
+
+/* Builds the edit script turning a into b; returns the number of ops */
+int diff_lines(const LineFile *a, const LineFile *b, DiffOp **ops) {
+    int n = a->count, m = b->count, prefix = 0, suffix = 0;
+    while (prefix < n && prefix < m && lines_equal(&a->lines[prefix], &b->lines[prefix])) prefix++;
+    while (suffix < n - prefix && suffix < m - prefix &&
+           lines_equal(&a->lines[n - 1 - suffix], &b->lines[m - 1 - suffix])) suffix++;
+
+    char *a_changed = calloc(n + 1, 1), *b_changed = calloc(m + 1, 1);
+    myers_diff(a->lines + prefix, n - prefix - suffix, b->lines + prefix, m - prefix - suffix,
+               a_changed + prefix, b_changed + prefix);
+
+    DiffOp *out = malloc(sizeof(DiffOp) * (n + m + 1));
+    int count = 0, i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && a_changed[i]) {
+            out[count++] = (DiffOp){'-', i++, j};
+        } else if (j < m && b_changed[j]) {
+            out[count++] = (DiffOp){'+', i, j++};
+        } else {
+            out[count++] = (DiffOp){' ', i++, j++};
+        }
+    }
+    free(a_changed);
+    free(b_changed);
+    *ops = out;
+    return count;
+}
+
+static void write_diff_line(FILE *out, char type, const Line *l) {
+    fputc(type, out);
+    fwrite(l->text, 1, l->len, out);
+    if (l->len == 0 || l->text[l->len - 1] != '\n') fputs("\n\\ No newline at end of file\n", out);
+}
+
+/* Unified hunks for an edit script; changes closer than 2*context merge */
+void write_unified(FILE *out, const LineFile *a, const LineFile *b, const DiffOp *ops, int count, int context) {
+    int i = 0, emitted = 0;
+    while (i < count) {
+        while (i < count && ops[i].type == ' ') i++;
+        if (i == count) break;
+
+        int start = i - context > emitted ? i - context : emitted;
+        int end = i;
+        for (;;) {
+            while (end < count && ops[end].type != ' ') end++;
+            int next = end;
+            while (next < count && ops[next].type == ' ') next++;
+            if (next < count && next - end <= 2 * context) {
+                end = next;
+                continue;
+            }
+            end = end + context < count ? end + context : count;
+            break;
+        }
+
+        int a_len = 0, b_len = 0;
+        for (int k = start; k < end; k++) {
+            if (ops[k].type != '+') a_len++;
+            if (ops[k].type != '-') b_len++;
+        }
+        fprintf(out, "@@ -%d,%d +%d,%d @@\n", a_len ? ops[start].a + 1 : ops[start].a, a_len,
+                b_len ? ops[start].b + 1 : ops[start].b, b_len);
+        for (int k = start; k < end; k++) {
+            if (ops[k].type == '+') write_diff_line(out, '+', &b->lines[ops[k].b]);
+            else write_diff_line(out, ops[k].type, &a->lines[ops[k].a]);
+        }
+        emitted = i = end;
+    }
+}
+
+/* One file's change as a patch section; an empty hash means the side is absent */
+int write_file_patch(FILE *out, const char *path, const char *old_hash, const char *new_hash) {
+    LineFile a, b;
+    if (load_object_lines(old_hash, &a) != 0) return -1;
+    if (load_object_lines(new_hash, &b) != 0) {
+        free_lines(&a);
+        return -1;
+    }
+    fprintf(out, "diff --vcs a/%s b/%s\n", path, path);
+    if (!old_hash[0]) fprintf(out, "new file\n");
+    fprintf(out, "index %s..%s\n", old_hash[0] ? old_hash : "0", new_hash[0] ? new_hash : "0");
+    if (a.binary || b.binary) {
+        fprintf(out, "Binary files differ\n");
+    } else {
+        fprintf(out, "--- %s%s\n+++ %s%s\n", old_hash[0] ? "a/" : "", old_hash[0] ? path : "/dev/null",
+                new_hash[0] ? "b/" : "", new_hash[0] ? path : "/dev/null");
+        DiffOp *ops;
+        int count = diff_lines(&a, &b, &ops);
+        write_unified(out, &a, &b, ops, count, DIFF_CONTEXT);
+        free(ops);
+    }
+    free_lines(&a);
+    free_lines(&b);
+    return 0;
+}
+
+/* Tree hash recorded for a commit id (prefix); branches have none */
+int commit_tree_hash(const char *rev, char *tree_hash) {
+    char path[sizeof(BRANCH_HEADS) + MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.txt", BRANCH_HEADS, rev);
+    if (access(path, F_OK) == 0) return -1;
+
+    DIR *dir = opendir(BRANCHES_DIR);
+    if (!dir) return -1;
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (!strstr(entry->d_name, ".log")) continue;
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        FILE *log = fopen(path, "r");
+        if (!log) continue;
+        char line[512], id[64];
+        int inside = 0;
+        while (!found && fgets(line, sizeof(line), log)) {
+            if (strncmp(line, "commit ", 7) == 0) {
+                if (inside) break;
+                sscanf(line, "commit %63s", id);
+                inside = strncmp(id, rev, strlen(rev)) == 0;
+            } else if (inside && sscanf(line, "tree %64s", tree_hash) == 1) {
+                found = 1;
+            }
+        }
+        fclose(log);
+    }
+    closedir(dir);
+    return found ? 0 : -1;
+}
+
+/*
+ * A snapshot as sorted "<hash> <path>" lines, the tree object format. The
+ * lines are normally a read-only mapping of the tree object itself; only
+ * branches without a commit of their own are rebuilt from the manifest.
+ */
+typedef struct TreeView {
+    const char *data;
+    size_t size;
+    void *map;
+    size_t map_len;
+    char *owned;
+} TreeView;
+
+/* Maps an object's content wherever it lives; loose and packed alike */
+static int map_object(const char *hash, TreeView *v) {
+    long size;
+    FILE *f = open_object(hash, &size);
+    if (!f) return -1;
+    v->size = size;
+    if (size == 0) {
+        v->data = "";
+        fclose(f);
+        return 0;
+    }
+    if (fileno(f) < 0) {
+        v->owned = malloc(size);
+        if (fread(v->owned, 1, size, f) != (size_t)size) {
+            fclose(f);
+            free(v->owned);
+            v->owned = NULL;
+            return -1;
+        }
+        fclose(f);
+        v->data = v->owned;
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t offset = ftello(f), base = offset / page * page;
+    v->map_len = offset - base + size;
+    v->map = mmap(NULL, v->map_len, PROT_READ, MAP_PRIVATE, fileno(f), base);
+    fclose(f);
+    if (v->map == MAP_FAILED) {
+        v->map = NULL;
+        return -1;
+    }
+    madvise(v->map, v->map_len, MADV_SEQUENTIAL);
+    v->data = (const char *)v->map + (offset - base);
+    return 0;
+}
+
+/* Tree hash of a branch's newest commit, found by scanning its log backwards */
+static int branch_tree_hash(const char *branch, char *tree_hash) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.log", BRANCHES_DIR, branch);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) return -1;
+    int found = 0;
+    for (const char *p = log + st.st_size; p > log && !found;) {
+        const char *line = p - 1;
+        while (line > log && line[-1] != '\n') line--;
+        found = p - line > 5 && strncmp(line, "tree ", 5) == 0 && sscanf(line, "tree %64s", tree_hash) == 1;
+        p = line;
+    }
+    munmap((void *)log, st.st_size);
+    return found ? 0 : -1;
+}
+
+static int open_tree_view(const char *rev, TreeView *v) {
+    memset(v, 0, sizeof(*v));
+    char hash[HASH_SIZE];
+    if (branch_tree_hash(rev, hash) == 0 || commit_tree_hash(rev, hash) == 0) {
+        char *wanted[] = {hash};
+        fetch_missing_objects(wanted, 1);
+        return map_object(hash, v);
+    }
+    Tree tree = {0};
+    if (load_commit_tree(rev, &tree) != 0) return -1;
+    size_t len = 0, cap = 4096;
+    v->owned = malloc(cap);
+    for (int i = 0; i < tree.count; i++) {
+        size_t need = strlen(tree.entries[i].hash) + strlen(tree.entries[i].path) + 3;
+        while (len + need >= cap) v->owned = realloc(v->owned, cap *= 2);
+        len += sprintf(v->owned + len, "%s %s\n", tree.entries[i].hash, tree.entries[i].path);
+    }
+    free_tree(&tree);
+    v->data = v->owned;
+    v->size = len;
+    return 0;
+}
+
+static void close_tree_view(TreeView *v) {
+    if (v->map) munmap(v->map, v->map_len);
+    free(v->owned);
+    memset(v, 0, sizeof(*v));
+}
+
+/* Path of the tree line at p, and its length */
+static const char *tree_line_path(const char *p, const char *end, size_t *len) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *path = memchr(p, ' ', (nl ? nl : end) - p);
+    path = path ? path + 1 : (nl ? nl : end);
+    *len = (nl ? nl : end) - path;
+    return path;
+}
+
+#define DIFF_PATCH 0
+#define DIFF_STAT 1
+#define DIFF_NAME_STATUS 2
+
+/* A path that differs between two snapshots; empty hashes mark a missing side */
+typedef struct FileChange {
+    const char *path;
+    const char *old_hash;
+    const char *new_hash;
+    int added;
+    int deleted;
+    int binary;
+    int failed;
+} FileChange;
+
+static void count_change(void *arg, int i) {
+    FileChange *c = &((FileChange *)arg)[i];
+    LineFile a, b;
+    if (load_object_lines(c->old_hash, &a) != 0) {
+        c->failed = 1;
+        return;
+    }
+    if (load_object_lines(c->new_hash, &b) != 0) {
+        free_lines(&a);
+        c->failed = 1;
+        return;
+    }
+    c->binary = a.binary || b.binary;
+    if (!c->binary) {
+        DiffOp *ops;
+        int count = diff_lines(&a, &b, &ops);
+        for (int k = 0; k < count; k++) {
+            if (ops[k].type == '+') c->added++;
+            else if (ops[k].type == '-') c->deleted++;
+        }
+        free(ops);
+    }
+    free_lines(&a);
+    free_lines(&b);
+}
+
+static void print_stat(const FileChange *changes, int count) {
+    int width = 0, most = 0;
+    long added = 0, deleted = 0;
+    for (int i = 0; i < count; i++) {
+        int len = strlen(changes[i].path);
+        if (len > width) width = len;
+        if (changes[i].added + changes[i].deleted > most) most = changes[i].added + changes[i].deleted;
+    }
+    for (int i = 0; i < count; i++) {
+        const FileChange *c = &changes[i];
+        if (c->failed) {
+            printf(" %-*s | " COLOR_RED "missing object\n" COLOR_RESET, width, c->path);
+            continue;
+        }
+        if (c->binary) {
+            printf(" %-*s | Bin\n", width, c->path);
+            continue;
+        }
+        int total = c->added + c->deleted;
+        int plus = c->added, minus = c->deleted;
+        if (most > 50) {
+            plus = (int)((long)c->added * 50 / most);
+            minus = (int)((long)c->deleted * 50 / most);
+            if (c->added && !plus) plus = 1;
+            if (c->deleted && !minus) minus = 1;
+        }
+        printf(" %-*s | %5d " COLOR_GREEN, width, c->path, total);
+        for (int k = 0; k < plus; k++) putchar('+');
+        printf(COLOR_RED);
+        for (int k = 0; k < minus; k++) putchar('-');
+        printf(COLOR_RESET "\n");
+        added += c->added;
+        deleted += c->deleted;
+    }
+    printf(" %d file(s) changed, %ld insertion(s)(+), %ld deletion(s)(-)\n", count, added, deleted);
+}
+
+/* Copies the next "<hash> <path>" line of a tree view; 0 at the end */
+static int tree_view_next(const char **p, const char *end, char *hash, char *path) {
+    while (*p < end) {
+        size_t len;
+        const char *line = *p, *name = tree_line_path(line, end, &len);
+        *p = name + len < end ? name + len + 1 : end;
+        size_t hash_len = name > line ? name - 1 - line : 0;
+        if (hash_len == 0 || hash_len >= HASH_SIZE || len == 0 || len >= MAX_PATH_LEN) continue;
+        memcpy(hash, line, hash_len);
+        hash[hash_len] = 0;
+        memcpy(path, name, len);
+        path[len] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Compares two commits or branches. Both tree objects are mapped and
+ * walked in lockstep, as ls-tree does, so neither snapshot is loaded into
+ * memory; entries with equal hashes are skipped without reading content,
+ * so only blobs that actually changed are fetched and diffed.
+ * --name-status streams from the walk itself and patches are flushed file
+ * by file; --stat has to wait for every count to scale its bars, so its
+ * per-file line diffs run in parallel instead.
+ */
+void diff_commits(const char *rev_a, const char *rev_b, int mode) {
+    char tree_a[HASH_SIZE], tree_b[HASH_SIZE];
+    if (commit_tree_hash(rev_a, tree_a) == 0 && commit_tree_hash(rev_b, tree_b) == 0 &&
+        strcmp(tree_a, tree_b) == 0) {
+        if (mode == DIFF_STAT) print_stat(NULL, 0);
+        return;
+    }
+
+    TreeView a = {0}, b = {0};
+    const char *unknown = open_tree_view(rev_a, &a) != 0 ? rev_a : open_tree_view(rev_b, &b) != 0 ? rev_b : NULL;
+    if (unknown) {
+        printf("Unknown revision '%s'.\n", unknown);
+        close_tree_view(&a);
+        close_tree_view(&b);
+        return;
+    }
+
+    FileChange *changes = NULL;
+    int count = 0, capacity = 0;
+    const char *pa = a.data, *end_a = a.data + a.size, *pb = b.data, *end_b = b.data + b.size;
+    char path_a[MAX_PATH_LEN], hash_a[HASH_SIZE], path_b[MAX_PATH_LEN], hash_b[HASH_SIZE];
+    int more_a = tree_view_next(&pa, end_a, hash_a, path_a), more_b = tree_view_next(&pb, end_b, hash_b, path_b);
+    while (more_a || more_b) {
+        output_poll();
+        int cmp = !more_a ? 1 : !more_b ? -1 : strcmp(path_a, path_b);
+        if (cmp != 0 || strcmp(hash_a, hash_b) != 0) {
+            if (mode == DIFF_NAME_STATUS) {
+                printf("%c\t%s\n", cmp < 0 ? 'D' : cmp > 0 ? 'A' : 'M', cmp <= 0 ? path_a : path_b);
+                output_record();
+            } else {
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    changes = realloc(changes, sizeof(FileChange) * capacity);
+                }
+                FileChange *c = &changes[count++];
+                memset(c, 0, sizeof(*c));
+                c->path = strdup(cmp <= 0 ? path_a : path_b);
+                c->old_hash = strdup(cmp <= 0 ? hash_a : "");
+                c->new_hash = strdup(cmp >= 0 ? hash_b : "");
+            }
+        }
+        if (cmp <= 0) more_a = tree_view_next(&pa, end_a, hash_a, path_a);
+        if (cmp >= 0) more_b = tree_view_next(&pb, end_b, hash_b, path_b);
+    }
+    close_tree_view(&a);
+    close_tree_view(&b);
+
+    if (mode != DIFF_NAME_STATUS) {
+        // One promisor round trip for every blob the diff will read
+        char **wanted = malloc(sizeof(char *) * (2 * count + 1));
+        int wanted_count = 0;
+        for (int k = 0; k < count; k++) {
+            if (changes[k].old_hash[0]) wanted[wanted_count++] = (char *)changes[k].old_hash;
+            if (changes[k].new_hash[0]) wanted[wanted_count++] = (char *)changes[k].new_hash;
+        }
+        fetch_missing_objects(wanted, wanted_count);
+        free(wanted);
+
+        if (mode == DIFF_STAT) {
+            parallel_for(count, default_jobs(), count_change, changes);
+            print_stat(changes, count);
+        } else {
+            for (int k = 0; k < count; k++) {
+                if (write_file_patch(stdout, changes[k].path, changes[k].old_hash, changes[k].new_hash) != 0) {
+                    printf(COLOR_RED "Object for '%s' is missing.\n" COLOR_RESET, changes[k].path);
+                }
+                output_record();
+            }
+        }
+    }
+    for (int k = 0; k < count; k++) {
+        free((char *)changes[k].path);
+        free((char *)changes[k].old_hash);
+        free((char *)changes[k].new_hash);
+    }
+    free(changes);
+}
+
+static void emit_commit_patch(const char *id, const char *message, const Tree *base, const Tree *changes) {
+    printf("From %s\nSubject: [PATCH] %s\n\n", id, message);
+    for (int i = 0; i < changes->count; i++) {
+        const TreeEntry *e = &changes->entries[i];
+        const TreeEntry *old = tree_find(base, e->path);
+        if (old && strcmp(old->hash, e->hash) == 0) continue;
+        if (write_file_patch(stdout, e->path, old ? old->hash : "", e->hash) != 0) {
+            fprintf(stderr, "Object for '%s' in commit %s is missing.\n", e->path, id);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Prints the current branch's commits in <from>..<to> (or a single commit)
+ * as patches. Each commit is diffed against the snapshot before it, which
+ * is built up while the log is read once from the top.
+ */
+void format_patch(const char *range) {
+    char from[64] = "", to[64] = "";
+    const char *dots = strstr(range, "..");
+    if (dots) {
+        snprintf(from, sizeof(from), "%.*s", (int)(dots - range), range);
+        snprintf(to, sizeof(to), "%s", dots + 2);
+    } else {
+        snprintf(to, sizeof(to), "%s", range);
+    }
+
+    char log_path[MAX_PATH_LEN];
+    get_branch_log_path(log_path);
+    FILE *log = fopen(log_path, "r");
+    if (!log) {
+        printf("No commits on this branch.\n");
+        return;
+    }
+
+    Tree base = {0}, changes = {0};
+    char line[512], id[64] = "", message[sizeof(line)] = "", filename[MAX_PATH_LEN], hash[HASH_SIZE];
+    int in_range = !dots || from[0] == 0, selected = 0, done = 0, emitted = 0;
+    while (!done) {
+        int more = fgets(line, sizeof(line), log) != NULL;
+        if (!more || strncmp(line, "commit ", 7) == 0) {
+            if (id[0]) {
+                tree_finalize(&changes);
+                if (selected) {
+                    emit_commit_patch(id, message, &base, &changes);
+                    emitted++;
+                    if (to[0] && strncmp(id, to, strlen(to)) == 0) done = 1;
+                }
+                for (int i = 0; i < changes.count; i++) tree_add(&base, changes.entries[i].path, changes.entries[i].hash);
+                tree_finalize(&base);
+                free_tree(&changes);
+                if (dots && from[0] && strncmp(id, from, strlen(from)) == 0) in_range = 1;
+            }
+            if (!more) break;
+            sscanf(line, "commit %63s", id);
+            message[0] = 0;
+            selected = in_range && (dots || strncmp(id, to, strlen(to)) == 0);
+        } else if (strncmp(line, "message: ", 9) == 0) {
+            snprintf(message, sizeof(message), "%s", line + 9);
+            message[strcspn(message, "\n")] = 0;
+        } else if (sscanf(line, "- %255s : %64s", filename, hash) == 2) {
+            tree_add(&changes, filename, hash);
+        }
+    }
+    fclose(log);
+    free_tree(&base);
+    free_tree(&changes);
+    if (emitted == 0) fprintf(stderr, "No commits match '%s'.\n", range);
+}
+
+/* One hunk of a patch: preimage and postimage lines */
+typedef struct Hunk {
+    int old_start;
+    LineFile pre;
+    LineFile post;
+    int pre_capacity;
+    int post_capacity;
+    int leading;       // context lines before the first change
+    int trailing;      // context lines after the last change
+} Hunk;
+
+static void free_hunk(Hunk *h) {
+    for (int i = 0; i < h->pre.count; i++) free((char *)h->pre.lines[i].text);
+    for (int i = 0; i < h->post.count; i++) free((char *)h->post.lines[i].text);
+    free(h->pre.lines);
+    free(h->post.lines);
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Finds where a hunk's preimage sits in the target, searching outward from
+ * the expected line. Without an exact match up to two context lines are
+ * dropped from each end, like patch's fuzz factor. Returns the position
+ * and the number of leading/trailing lines that were ignored.
+ */
+static int find_hunk(const LineFile *target, int cursor, int expected, const Hunk *h, int *skip_head, int *skip_tail) {
+    for (int fuzz = 0; fuzz <= 2; fuzz++) {
+        int head = fuzz < h->leading ? fuzz : h->leading;
+        int tail = fuzz < h->trailing ? fuzz : h->trailing;
+        if (fuzz > 0 && head == 0 && tail == 0) break;
+        int len = h->pre.count - head - tail;
+        int center = expected + head;
+        int span = target->count > center ? target->count : center;
+        for (int delta = 0; delta <= span; delta++) {
+            for (int side = 0; side < 2; side++) {
+                int p = side ? center - delta : center + delta;
+                if ((side && delta == 0) || p < cursor || p + len > target->count) continue;
+                int k = 0;
+                while (k < len && lines_equal(&target->lines[p + k], &h->pre.lines[head + k])) k++;
+                if (k == len) {
+                    *skip_head = head;
+                    *skip_tail = tail;
+                    return p;
+                }
+            }
+            if (center - delta < cursor && center + delta + len > target->count) break;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Patches may only touch working-tree files. The path is canonicalized in
+ * place, so "./.myvcs/..." or "a/../.myvcs/..." are judged by what they name.
+ */
+static int safe_patch_path(char *path, size_t size) {
+    char canonical[MAX_PATH_LEN];
+    size_t n = strlen(VCS_DIR);
+    if (!path[0] || path[0] == '/' || canonical_path(path, canonical, sizeof(canonical)) != 0) return 0;
+    if (!canonical[0] || (strncmp(canonical, VCS_DIR, n) == 0 && (canonical[n] == 0 || canonical[n] == '/'))) {
+        return 0;
+    }
+    snprintf(path, size, "%s", canonical);
+    return 1;
+}
+
+/* State for the file currently being patched */
+typedef struct ApplyFile {
+    char path[MAX_PATH_LEN];
+    char tmp[MAX_PATH_LEN + 8];
+    char old_hash[HASH_SIZE];
+    char new_hash[HASH_SIZE];
+    int deleting;
+    int creating;
+    LineFile target;
+    FILE *out;
+    int cursor;
+    int offset;
+    int hunk;
+    int failed;
+    int skip;
+} ApplyFile;
+
+static void write_lines(FILE *out, const Line *lines, int count) {
+    for (int i = 0; i < count; i++) fwrite(lines[i].text, 1, lines[i].len, out);
+}
+
+static int apply_begin(ApplyFile *af, int check) {
+    af->cursor = af->offset = af->hunk = af->failed = af->skip = 0;
+    if (!safe_patch_path(af->path, sizeof(af->path))) {
+        printf(COLOR_RED "Refusing to patch '%s'.\n" COLOR_RESET, af->path);
+        af->failed = 1;
+        return -1;
+    }
+    if (load_file_lines(af->path, &af->target) != 0) {
+        if (!af->creating) {
+            printf(COLOR_RED "%s: does not exist\n" COLOR_RESET, af->path);
+            af->failed = 1;
+            return -1;
+        }
+        split_lines(&af->target, NULL, 0);
+    } else if (af->new_hash[0] && strcmp(af->new_hash, "0") != 0) {
+        char hash[HASH_SIZE];
+        simple_hash_buffer(af->target.data, af->target.size, hash);
+        if (strcmp(hash, af->new_hash) == 0) {
+            printf("%s: already applied\n", af->path);
+            af->skip = 1;
+            return 0;
+        }
+    }
+    if (check) return 0;
+    snprintf(af->tmp, sizeof(af->tmp), "%s.tmp", af->path);
+    make_parent_dirs(af->path);
+    af->out = fopen(af->tmp, "wb");
+    if (!af->out) {
+        printf(COLOR_RED "%s: cannot write\n" COLOR_RESET, af->path);
+        af->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void apply_hunk(ApplyFile *af, Hunk *h) {
+    af->hunk++;
+    if (af->failed || af->skip) return;
+    int expected = (h->old_start > 0 ? h->old_start - 1 : 0) + af->offset;
+    int head, tail;
+    int p = find_hunk(&af->target, af->cursor, expected, h, &head, &tail);
+    if (p < 0) {
+        printf(COLOR_RED "%s: hunk %d does not apply\n" COLOR_RESET, af->path, af->hunk);
+        af->failed = 1;
+        return;
+    }
+    if (af->out) {
+        write_lines(af->out, af->target.lines + af->cursor, p - af->cursor);
+        write_lines(af->out, h->post.lines + head, h->post.count - head - tail);
+    }
+    af->cursor = p + h->pre.count - head - tail;
+    af->offset = p - head - (h->old_start > 0 ? h->old_start - 1 : 0);
+}
+
+static int apply_end(ApplyFile *af) {
+    int ok = !af->failed;
+    if (af->out) {
+        if (ok) write_lines(af->out, af->target.lines + af->cursor, af->target.count - af->cursor);
+        ok = fclose(af->out) == 0 && ok;
+        af->out = NULL;
+        if (ok && af->deleting) {
+            struct stat st;
+            ok = stat(af->tmp, &st) == 0 && st.st_size == 0 && remove(af->path) == 0;
+            remove(af->tmp);
+        } else if (ok) {
+            ok = rename(af->tmp, af->path) == 0;
+        } else {
+            remove(af->tmp);
+        }
+    }
+    free_lines(&af->target);
+    af->path[0] = 0;
+    return ok;
+}
+
+static void hunk_add(LineFile *f, int *capacity, const char *text, size_t len) {
+    add_line(f, capacity, strndup(text, len), len);
+}
+
+/* Drops the newline of the last line added ("\ No newline at end of file") */
+static void strip_newline(LineFile *f) {
+    if (f->count == 0) return;
+    Line *l = &f->lines[f->count - 1];
+    if (l->len && l->text[l->len - 1] == '\n') {
+        l->len--;
+        l->hash = line_hash(l->text, l->len);
+    }
+}
+
+/*
+ * Applies a unified diff (format-patch output or plain diff -u) to the
+ * working tree, streaming the patch one hunk at a time. Each file is
+ * rewritten through a temp file, so a file whose hunks do not all apply
+ * is left untouched.
+ */
+void apply_patch(const char *patch_path, int check) {
+    FILE *patch = strcmp(patch_path, "-") == 0 ? stdin : fopen(patch_path, "r");
+    if (!patch) {
+        printf("Cannot open patch '%s'.\n", patch_path);
+        return;
+    }
+    io_sequential(fileno(patch));
+
+    ApplyFile af;
+    memset(&af, 0, sizeof(af));
+    Hunk h;
+    memset(&h, 0, sizeof(h));
+    char *line = NULL, old_path[MAX_PATH_LEN] = "";
+    size_t cap = 0;
+    ssize_t len;
+    int applied = 0, failed = 0, old_left = 0, new_left = 0, in_hunk = 0, pending = 0, creating = 0;
+    char last = 0;
+    char old_hash[HASH_SIZE] = "", new_hash[HASH_SIZE] = "";
+
+    while ((len = getline(&line, &cap, patch)) != -1) {
+        if ((in_hunk || pending) && line[0] == '\\') {
+            if (last != '+') strip_newline(&h.pre);
+            if (last != '-') strip_newline(&h.post);
+            continue;
+        }
+        if (pending) {
+            // Only applied now: a "\ No newline" marker may have followed it
+            apply_hunk(&af, &h);
+            free_hunk(&h);
+            pending = 0;
+        }
+        if (in_hunk) {
+            char type = line[0] == '\n' ? ' ' : line[0];
+            const char *text = line[0] == '\n' ? line : line + 1;
+            size_t text_len = line[0] == '\n' ? (size_t)len : (size_t)len - 1;
+            if (type == ' ' || type == '-') {
+                hunk_add(&h.pre, &h.pre_capacity, text, text_len);
+                old_left--;
+            }
+            if (type == ' ' || type == '+') {
+                hunk_add(&h.post, &h.post_capacity, text, text_len);
+                new_left--;
+            }
+            if (type == ' ') {
+                if (h.pre.count == h.leading + 1 && h.post.count == h.leading + 1) h.leading++;
+                h.trailing++;
+            } else {
+                h.trailing = 0;
+            }
+            last = type;
+            if (old_left <= 0 && new_left <= 0) {
+                in_hunk = 0;
+                pending = 1;
+            }
+            continue;
+        }
+
+        if (strncmp(line, "diff ", 5) == 0 || strncmp(line, "From ", 5) == 0) {
+            if (af.path[0]) {
+                if (apply_end(&af)) applied++;
+                else failed++;
+            }
+            old_hash[0] = new_hash[0] = 0;
+            creating = 0;
+        } else if (strncmp(line, "new file", 8) == 0) {
+            creating = 1;
+        } else if (strncmp(line, "index ", 6) == 0) {
+            sscanf(line, "index %64[^.]..%64s", old_hash, new_hash);
+        } else if (strncmp(line, "--- ", 4) == 0) {
+            sscanf(line + 4, "%255s", old_path);
+        } else if (strncmp(line, "+++ ", 4) == 0) {
+            if (af.path[0]) {
+                if (apply_end(&af)) applied++;
+                else failed++;
+            }
+            char new_path[MAX_PATH_LEN] = "";
+            sscanf(line + 4, "%255s", new_path);
+            af.deleting = strcmp(new_path, "/dev/null") == 0;
+            af.creating = creating || strcmp(old_path, "/dev/null") == 0;
+            const char *path = af.deleting ? old_path : new_path;
+            if (strncmp(path, "a/", 2) == 0 || strncmp(path, "b/", 2) == 0) path += 2;
+            snprintf(af.path, sizeof(af.path), "%s", path);
+            snprintf(af.old_hash, sizeof(af.old_hash), "%s", old_hash);
+            snprintf(af.new_hash, sizeof(af.new_hash), "%s", new_hash);
+            apply_begin(&af, check);
+        } else if (strncmp(line, "@@ -", 4) == 0 && af.path[0]) {
+            int old_start = 0, old_count = 1, new_start = 0, new_count = 1;
+            if (sscanf(line, "@@ -%d,%d +%d,%d @@", &old_start, &old_count, &new_start, &new_count) != 4 &&
+                sscanf(line, "@@ -%d +%d,%d @@", &old_start, &new_start, &new_count) != 3 &&
+                sscanf(line, "@@ -%d,%d +%d @@", &old_start, &old_count, &new_start) != 3) {
+                sscanf(line, "@@ -%d +%d @@", &old_start, &new_start);
+            }
+            h.old_start = old_start;
+            old_left = old_count;
+            new_left = new_count;
+            in_hunk = old_left > 0 || new_left > 0;
+        }
+    }
+    if (pending) apply_hunk(&af, &h);
+    if (af.path[0]) {
+        if (apply_end(&af)) applied++;
+        else failed++;
+    }
+    free_hunk(&h);
+    free(line);
+    if (patch != stdin) fclose(patch);
+
+    if (failed) printf(COLOR_RED "%d file(s) could not be patched.\n" COLOR_RESET, failed);
+    printf("%s %d file(s).\n", check ? "Checked" : "Patched", applied);
+}
+
+#ifdef VCS_FUSE
+/*
+ * Read-only view of a snapshot. Listings come straight from the tree and
+ * reads are served with pread() on the object file; content never changes,
+ * so the kernel page cache is allowed to keep it across opens.
+ */
+static Tree mount_tree;
+static int mount_root_fd = -1;
+
+/* Open file: the object's range inside a loose file or a pack */
+typedef struct MountHandle {
+    FILE *file;
+    long base;
+    long size;
+} MountHandle;
+
+static void *vcsfs_init(struct fuse_conn_info *conn) {
+    (void)conn;
+    // Back into the repository so promisor fetches resolve relative paths
+    if (fchdir(mount_root_fd) != 0) perror("fchdir");
+    return NULL;
+}
+
+static FILE *mount_open_object(const TreeEntry *e, long *size) {
+    FILE *f = open_object(e->hash, size);
+    if (!f) {
+        char *one = (char *)e->hash;
+        fetch_missing_objects(&one, 1);
+        f = open_object(e->hash, size);
+    }
+    return f;
+}
+
+static const TreeEntry *mount_lookup(const char *path) {
+    return tree_find(&mount_tree, path + 1);
+}
+
+static int mount_is_dir(const char *path) {
+    if (strcmp(path, "/") == 0) return 1;
+    char prefix[MAX_PATH_LEN];
+    snprintf(prefix, sizeof(prefix), "%s/", path + 1);
+    int i = tree_lower_bound(&mount_tree, prefix);
+    return i < mount_tree.count && strncmp(mount_tree.entries[i].path, prefix, strlen(prefix)) == 0;
+}
+
+static int vcsfs_getattr(const char *path, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    const TreeEntry *e = mount_lookup(path);
+    if (e) {
+        long size;
+        FILE *f = mount_open_object(e, &size);
+        if (!f) return -EIO;
+        fclose(f);
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = size;
+        return 0;
+    }
+    if (mount_is_dir(path)) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int vcsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+    (void)offset;
+    (void)fi;
+    char prefix[MAX_PATH_LEN] = "";
+    if (strcmp(path, "/") != 0) snprintf(prefix, sizeof(prefix), "%s/", path + 1);
+    size_t plen = strlen(prefix);
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    // Children of a directory are contiguous in the sorted tree
+    char last[MAX_PATH_LEN] = "";
+    for (int i = tree_lower_bound(&mount_tree, prefix); i < mount_tree.count; i++) {
+        const char *p = mount_tree.entries[i].path;
+        if (strncmp(p, prefix, plen) != 0) break;
+        char name[MAX_PATH_LEN];
+        snprintf(name, sizeof(name), "%s", p + plen);
+        name[strcspn(name, "/")] = 0;
+        if (strcmp(name, last) == 0) continue;
+        strcpy(last, name);
+        filler(buf, name, NULL, 0);
+    }
+    return 0;
+}
+
+static int vcsfs_open(const char *path, struct fuse_file_info *fi) {
+    const TreeEntry *e = mount_lookup(path);
+    if (!e) return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    MountHandle *h = malloc(sizeof(MountHandle));
+    h->file = mount_open_object(e, &h->size);
+    if (!h->file) {
+        free(h);
+        return -EIO;
+    }
+    h->base = ftell(h->file);
+    fi->fh = (unsigned long)h;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int vcsfs_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+    (void)path;
+    MountHandle *h = (MountHandle *)fi->fh;
+    if (offset >= h->size) return 0;
+    if ((long)size > h->size - offset) size = h->size - offset;
+    if (fileno(h->file) < 0) {
+        // Inflated objects live in memory; serialize the seek and read
+        flockfile(h->file);
+        size_t n = fseek(h->file, h->base + offset, SEEK_SET) == 0 ? fread(buf, 1, size, h->file) : 0;
+        funlockfile(h->file);
+        return (int)n;
+    }
+    ssize_t n = pread(fileno(h->file), buf, size, h->base + offset);
+    return n < 0 ? -errno : (int)n;
+}
+
+static int vcsfs_release(const char *path, struct fuse_file_info *fi) {
+    (void)path;
+    MountHandle *h = (MountHandle *)fi->fh;
+    fclose(h->file);
+    free(h);
+    return 0;
+}
+
+static struct fuse_operations vcsfs_ops = {
+    .init = vcsfs_init,
+    .getattr = vcsfs_getattr,
+    .readdir = vcsfs_readdir,
+    .open = vcsfs_open,
+    .read = vcsfs_read,
+    .release = vcsfs_release,
+};
+#endif
+
+void mount_commit(const char *rev, const char *mountpoint) {
+#ifdef VCS_FUSE
+    if (load_commit_tree(rev, &mount_tree) != 0) {
+        printf("Commit or branch '%s' not found.\n", rev);
+        return;
+    }
+    // FUSE daemonizes and leaves the repository directory, so hold on to it
+    mount_root_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (mount_root_fd < 0) {
+        printf("Failed to open repository.\n");
+        free_tree(&mount_tree);
+        return;
+    }
+
+    printf("Mounting '%s' (%d files) at %s\n", rev, mount_tree.count, mountpoint);
+    fflush(stdout);
+    char *fuse_argv[] = {"vcs", (char *)mountpoint, "-o",
+                         "ro,kernel_cache,fsname=vcs,entry_timeout=3600,attr_timeout=3600", NULL};
+    fuse_main(4, fuse_argv, &vcsfs_ops, NULL);
+
+    close(mount_root_fd);
+    free_tree(&mount_tree);
+#else
+    (void)rev;
+    (void)mountpoint;
+    printf("This vcs was built without FUSE support (rebuild with 'make FUSE=1').\n");
+#endif
+}
+
+static void copy_dir_files(const char *src_dir, const char *dest_dir) {
+    DIR *dir = opendir(src_dir);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char from[PATH_MAX], to[PATH_MAX];
+        snprintf(from, sizeof(from), "%s/%s", src_dir, entry->d_name);
+        snprintf(to, sizeof(to), "%s/%s", dest_dir, entry->d_name);
+        copy_file(from, to);
+    }
+    closedir(dir);
+}
+
+/* core.objectFormat of any repository's config; unset means djb2 */
+static void config_object_format(const char *config, char *format, size_t size) {
+    snprintf(format, size, "djb2");
+    FILE *f = fopen(config, "r");
+    char line[512], value[64];
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " core.objectFormat = %63s", value) == 1) snprintf(format, size, "%s", value);
+    }
+    if (f) fclose(f);
+}
+
+/* Appends value as a line unless the file already has it */
+static int append_unique_line(const char *path, const char *value) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    FILE *f = fd >= 0 ? fdopen(fd, "a+") : NULL;
+    if (!f) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+    char line[PATH_MAX];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        found = strcmp(line, value) == 0;
+    }
+    if (!found) fprintf(f, "%s\n", value);
+    return fclose(f);
+}
+
+/*
+ * Makes the repository in the cwd read objects from another object store.
+ * The store learns about its new borrower first, so a gc running there
+ * never misses what this repository reaches.
+ */
+static int borrow_objects(const char *store) {
+    char real[PATH_MAX], self[PATH_MAX], path[PATH_MAX + 32], theirs[64], ours[64];
+    if (!realpath(store, real) || !getcwd(self, sizeof(self))) {
+        printf("'%s' is not an object store.\n", store);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/../config", real);
+    config_object_format(path, theirs, sizeof(theirs));
+    config_object_format(CONFIG_FILE, ours, sizeof(ours));
+    if (strcmp(theirs, ours) != 0) {
+        printf("'%s' uses %s objects, this repository %s.\n", store, theirs, ours);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/info", real);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/info/borrowers", real);
+    mkdir(OBJECTS_DIR "/info", 0755);
+    if (append_unique_line(path, self) != 0 || append_unique_line(ALTERNATES_FILE, real) != 0) {
+        printf("Cannot borrow objects from '%s'.\n", store);
+        return -1;
+    }
+    unload_packs();
+    return 0;
+}
+
+/* vcs alternates [add <repository>]: lists or adds the stores objects are borrowed from */
+void alternates_command(const char *add) {
+    if (add) {
+        // The store is usually a sibling, so this path may well leave the root
+        char arg[PATH_MAX], store[3 * PATH_MAX], self[PATH_MAX];
+        if (add[0] == '/') snprintf(store, sizeof(store), "%s/%s", add, OBJECTS_DIR);
+        else snprintf(store, sizeof(store), "%s/%s%s/%s", repo.root, repo.prefix, add, OBJECTS_DIR);
+        if (realpath(store, arg) && realpath(OBJECTS_DIR, self) && strcmp(arg, self) == 0) {
+            printf("A repository cannot borrow from itself.\n");
+        } else if (access(store, F_OK) != 0) {
+            printf("'%s' is not a repository.\n", add);
+        } else if (borrow_objects(store) == 0) {
+            printf("Borrowing objects from '%s'.\n", arg);
+        }
+        return;
+    }
+    timed_lock(&pack_lock);
+    load_packs();
+    for (int i = 0; i < pack_set.alternate_count; i++) printf("%s\n", pack_set.alternates[i].objects);
+    pthread_mutex_unlock(&pack_lock);
+}
+
+/*
+ * Clones a local repository. With --filter=blob:none or blob:limit=<n> only
+ * tree objects and small blobs are copied; everything else is fetched from
+ * the source (recorded as the promisor) when a command first needs it.
+ * With --shared nothing is copied: the clone borrows the source's objects.
+ */
+void clone_repo(const char *source, const char *dest, const char *filter, int shared) {
+    long limit = LONG_MAX;
+    if (filter) {
+        char unit = 0;
+        if (strcmp(filter, "blob:none") == 0) {
+            limit = -1;
+        } else if (sscanf(filter, "blob:limit=%ld%c", &limit, &unit) >= 1) {
+            if (unit == 'k' || unit == 'K') limit *= 1024;
+            else if (unit == 'm' || unit == 'M') limit *= 1024 * 1024;
+            else if (unit == 'g' || unit == 'G') limit *= 1024L * 1024 * 1024;
+        } else {
+            printf("Unsupported filter '%s' (use blob:none or blob:limit=<n>).\n", filter);
+            return;
+        }
+    }
+
+    char src_root[PATH_MAX], path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", source, VCS_DIR);
+    if (!realpath(source, src_root) || access(path, F_OK) != 0) {
+        printf("'%s' is not a repository.\n", source);
+        return;
+    }
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+        printf("Failed to create '%s'.\n", dest);
+        return;
+    }
+    if (chdir(dest) != 0 || mkdir(VCS_DIR, 0755) != 0) {
+        printf("Repository already exists in '%s'.\n", dest);
+        return;
+    }
+    forget_repository();
+    mkdir(OBJECTS_DIR, 0755);
+    mkdir(BRANCHES_DIR, 0755);
+    mkdir(BRANCH_HEADS, 0755);
+
+    char from[PATH_MAX + MAX_PATH_LEN];
+    snprintf(from, sizeof(from), "%s/%s", src_root, HEAD_FILE);
+    copy_file(from, HEAD_FILE);
+    snprintf(from, sizeof(from), "%s/%s", src_root, COMMIT_FILE);
+    copy_file(from, COMMIT_FILE);
+    snprintf(from, sizeof(from), "%s/%s", src_root, CONFIG_FILE);
+    copy_file(from, CONFIG_FILE);
+    snprintf(from, sizeof(from), "%s/%s", src_root, BRANCHES_DIR);
+    copy_dir_files(from, BRANCHES_DIR);
+    snprintf(from, sizeof(from), "%s/%s", src_root, BRANCH_HEADS);
+    copy_dir_files(from, BRANCH_HEADS);
+    // Packed objects may be compressed against any dictionary ever trained
+    snprintf(from, sizeof(from), "%s/%s", src_root, DICT_DIR);
+    if (access(from, F_OK) == 0 && mkdir(DICT_DIR, 0755) == 0) copy_dir_files(from, DICT_DIR);
+    FILE *f = fopen(INDEX_FILE, "w");
+    if (f) fclose(f);
+
+    // Objects the source borrows are borrowed by the clone too
+    snprintf(from, sizeof(from), "%s/%s", src_root, ALTERNATES_FILE);
+    f = fopen(from, "r");
+    char line[PATH_MAX];
+    while (f && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0] || line[0] == '#') continue;
+        if (line[0] == '/') snprintf(from, sizeof(from), "%s", line);
+        else if (snprintf(from, sizeof(from), "%s/%s/%s", src_root, OBJECTS_DIR, line) >= (int)sizeof(from)) continue;
+        borrow_objects(from);
+    }
+    if (f) fclose(f);
+    if (shared) {
+        snprintf(from, sizeof(from), "%s/%s", src_root, OBJECTS_DIR);
+        if (borrow_objects(from) != 0) return;
+        printf("Cloned '%s' into '%s' (objects borrowed from the source).\n", source, dest);
+        char branch[MAX_PATH_LEN];
+        get_current_branch(branch);
+        checkout_branch(branch);
+        return;
+    }
+
+    // Tree objects are always needed to resolve commits, whatever the filter
+    Tree trees = {0};
+    DIR *dir = opendir(BRANCHES_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        FILE *log = fopen(path, "r");
+        char line[512], hash[HASH_SIZE];
+        while (log && fgets(line, sizeof(line), log)) {
+            if (sscanf(line, "tree %64s", hash) == 1) tree_add(&trees, hash, hash);
+        }
+        if (log) fclose(log);
+    }
+    if (dir) closedir(dir);
+    tree_finalize(&trees);
+
+    int copied = 0, skipped = 0;
+    snprintf(from, sizeof(from), "%s/%s", src_root, OBJECTS_DIR);
+    dir = opendir(from);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char obj[sizeof(from) + MAX_PATH_LEN];
+        struct stat st;
+        snprintf(obj, sizeof(obj), "%s/%s", from, entry->d_name);
+        if (strchr(entry->d_name, '.') || stat(obj, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (!tree_find(&trees, entry->d_name) && st.st_size > limit) {
+            skipped++;
+            continue;
+        }
+        // Objects are immutable, so sharing the inode is as good as a copy
+        snprintf(path, sizeof(path), "%s/%s", OBJECTS_DIR, entry->d_name);
+        if (link(obj, path) != 0) copy_file(obj, path);
+        copied++;
+    }
+    if (dir) closedir(dir);
+
+    // Packed objects: whole packs when unfiltered, else only what passes
+    snprintf(from, sizeof(from), "%s/%s", src_root, PACK_DIR);
+    dir = opendir(from);
+    if (dir) mkdir(PACK_DIR, 0755);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0) continue;
+        char idx_path[sizeof(from) + MAX_PATH_LEN], pack_path[sizeof(from) + MAX_PATH_LEN];
+        snprintf(idx_path, sizeof(idx_path), "%s/%s", from, entry->d_name);
+        snprintf(pack_path, sizeof(pack_path), "%s/%.*s.pack", from, (int)(len - 4), entry->d_name);
+        FILE *idx = fopen(idx_path, "r");
+        char line[256];
+        PackedObject obj;
+        int whole = !filter;
+        while (idx && fgets(line, sizeof(line), idx)) {
+            if (!parse_pack_entry(line, &obj)) continue;
+            if (whole) {
+                copied++;
+                continue;
+            }
+            if (!tree_find(&trees, obj.hash) && obj.size > limit) {
+                skipped++;
+                continue;
+            }
+            char *data = read_packed_entry(pack_path, &obj);
+            if (data) {
+                store_object(obj.hash, data, obj.size);
+                copied++;
+            }
+            free(data);
+        }
+        if (idx) fclose(idx);
+        if (whole && strcmp(entry->d_name, "write.idx") == 0) {
+            // Still appended to by the source: copy, and the idx first so it never outruns the pack
+            copy_file(idx_path, WRITE_PACK_IDX);
+            copy_file(pack_path, WRITE_PACK);
+        } else if (whole) {
+            char to[PATH_MAX];
+            snprintf(to, sizeof(to), "%s/%.*s.pack", PACK_DIR, (int)(len - 4), entry->d_name);
+            if (link(pack_path, to) != 0) copy_file(pack_path, to);
+            snprintf(to, sizeof(to), "%s/%s", PACK_DIR, entry->d_name);
+            if (link(idx_path, to) != 0) copy_file(idx_path, to);
+        }
+    }
+    if (dir) closedir(dir);
+    unload_packs();
+    free_tree(&trees);
+
+    if (filter) {
+        f = fopen(PROMISOR_FILE, "w");
+        if (f) {
+            fprintf(f, "%s\n", src_root);
+            fclose(f);
+        }
+    }
+    printf("Cloned '%s' into '%s' (%d objects copied, %d left on promisor).\n",
+           source, dest, copied, skipped);
+
+    char branch[MAX_PATH_LEN];
+    get_current_branch(branch);
+    checkout_branch(branch);
+}
+
+/*
+ * Housekeeping. Each task does a bounded slice of work and checks the
+ * deadline between objects, so "maintenance run --budget=<ms>" can be
+ * scheduled from cron without stalling the commands running next to it.
+ * Objects are published before the files they replace are removed.
+ */
+typedef struct MaintenanceContext {
+    long deadline;  /* monotonic ms, 0 = unlimited */
+    int forced;     /* task named explicitly, skip thresholds */
+} MaintenanceContext;
+
+static int over_budget(const MaintenanceContext *ctx) {
+    return ctx->deadline && now_ms() >= ctx->deadline;
+}
+
+static int list_loose_objects(char ***names) {
+    *names = NULL;
+    DIR *dir = opendir(OBJECTS_DIR);
+    if (!dir) return 0;
+    struct dirent *entry;
+    int count = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strchr(entry->d_name, '.')) continue;
+        if (strcmp(entry->d_name, "pack") == 0 || strcmp(entry->d_name, "info") == 0) continue;
+        *names = realloc(*names, sizeof(char *) * (count + 1));
+        (*names)[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    return count;
+}
+
+static void free_names(char **names, int count) {
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
+
+/*
+ * Writes the idx (entries arrive as "<hash> <offset> <size>" lines and are
+ * sorted within the memory budget), then publishes pack before idx.
+ */
+static int publish_pack(FILE *pack, const char *pack_tmp, ExtSorter *entries, char *name) {
+    static int sequence = 0;
+    extsort_finish(entries);
+    snprintf(name, MAX_PATH_LEN, "pack-%ld-%d-%d", (long)time(NULL), (int)getpid(), sequence++);
+    char idx_tmp[MAX_PATH_LEN], final[MAX_PATH_LEN];
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s/%s.idx.tmp", PACK_DIR, name);
+    FILE *idx = fopen(idx_tmp, "w");
+    if (!idx) return -1;
+    const char *line;
+    while ((line = extsort_next(entries)) != NULL) fprintf(idx, "%s\n", line);
+    fflush(pack);
+    fsync(fileno(pack));
+    fflush(idx);
+    fsync(fileno(idx));
+    fclose(idx);
+    snprintf(final, sizeof(final), "%s/%s.pack", PACK_DIR, name);
+    if (rename(pack_tmp, final) != 0) return -1;
+    snprintf(final, sizeof(final), "%s/%s.idx", PACK_DIR, name);
+    if (rename(idx_tmp, final) != 0) return -1;
+    unload_packs();
+    return 0;
+}
+
+static long copy_stream(FILE *src, FILE *dest, long size) {
+    char buf[8192];
+    long copied = 0;
+    while (copied < size) {
+        size_t want = size - copied < (long)sizeof(buf) ? (size_t)(size - copied) : sizeof(buf);
+        size_t n = fread(buf, 1, want, src);
+        if (n == 0) break;
+        fwrite(buf, 1, n, dest);
+        copied += n;
+    }
+    return copied;
+}
+
+static void task_loose_objects(MaintenanceContext *ctx) {
+    char **names;
+    int count = list_loose_objects(&names);
+    long threshold = get_config_long("maintenance.looseThreshold", 100);
+    if (!ctx->forced && count < threshold) {
+        printf("  loose-objects: %d loose objects, below threshold %ld\n", count, threshold);
+        free_names(names, count);
+        return;
+    }
+    if (count == 0) {
+        printf("  loose-objects: nothing to pack\n");
+        free(names);
+        return;
+    }
+
+    mkdir(PACK_DIR, 0755);
+    char pack_tmp[MAX_PATH_LEN];
+    snprintf(pack_tmp, sizeof(pack_tmp), "%s/tmp-%d.pack", PACK_DIR, (int)getpid());
+    FILE *pack = fopen(pack_tmp, "wb");
+    if (!pack) {
+        free_names(names, count);
+        return;
+    }
+    ExtSorter entries;
+    extsort_init(&entries, 1);
+    DictCompressor compressor;
+    compressor_init(&compressor, current_dict(), Z_BEST_COMPRESSION);
+    char *packed_flags = calloc(count, 1);
+    int packed = 0;
+    long offset = 0;
+    for (int i = 0; i < count && !over_budget(ctx); i++) {
+        char path[MAX_PATH_LEN];
+        object_path(names[i], path);
+        FILE *obj = fopen(path, "rb");
+        if (!obj) continue;
+        struct stat st;
+        fstat(fileno(obj), &st);
+        if (io_use_direct(st.st_size)) {
+            // Packed objects cannot be read with O_DIRECT; leave huge ones loose
+            fclose(obj);
+            continue;
+        }
+        long n;
+        if (compressor.dict && st.st_size <= DICT_OBJECT_MAX) {
+            char *data = malloc(st.st_size + 1);
+            n = fread(data, 1, st.st_size, obj) == (size_t)st.st_size
+                    ? pack_append(pack, &compressor, names[i], data, st.st_size, offset, &entries)
+                    : -1;
+            free(data);
+            fclose(obj);
+            if (n < 0) continue;
+        } else {
+            io_sequential(fileno(obj));
+            n = copy_stream(obj, pack, st.st_size);
+            io_done(fileno(obj), 0, n, IO_ONCE);
+            fclose(obj);
+            char entry[HASH_SIZE + 48];
+            snprintf(entry, sizeof(entry), "%s %ld %ld", names[i], offset, n);
+            extsort_add(&entries, entry);
+        }
+        packed_flags[i] = 1;
+        offset += n;
+        packed++;
+    }
+
+    char name[MAX_PATH_LEN];
+    if (packed == 0 || publish_pack(pack, pack_tmp, &entries, name) != 0) {
+        fclose(pack);
+        remove(pack_tmp);
+    } else {
+        fclose(pack);
+        for (int i = 0; i < count; i++) {
+            if (!packed_flags[i]) continue;
+            char path[MAX_PATH_LEN];
+            object_path(names[i], path);
+            remove(path);
+        }
+        printf("  loose-objects: packed %d of %d objects into %s\n", packed, count, name);
+    }
+    compressor_end(&compressor);
+    extsort_free(&entries);
+    free(packed_flags);
+    free_names(names, count);
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static int compare_pack_sizes(const void *a, const void *b) {
+    long x = file_size(*(char *const *)a), y = file_size(*(char *const *)b);
+    return (x > y) - (x < y);
+}
+
+/* Merges the smallest packs into one until the pack count is under control */
+static void task_incremental_repack(MaintenanceContext *ctx) {
+    unload_packs();
+    load_packs();
+    long threshold = get_config_long("maintenance.packThreshold", 10);
+    // The write pack may be appended to right now; it is sealed when full
+    int packs = 0;
+    for (int i = 0; i < pack_set.local_packs; i++) packs += strcmp(pack_set.packs[i], WRITE_PACK) != 0;
+    if (packs < 2 || (!ctx->forced && packs < threshold)) {
+        printf("  incremental-repack: %d packs, below threshold %ld\n", packs, threshold);
+        return;
+    }
+
+    char **order = malloc(sizeof(char *) * packs);
+    for (int i = 0, n = 0; i < pack_set.local_packs; i++) {
+        if (strcmp(pack_set.packs[i], WRITE_PACK) != 0) order[n++] = strdup(pack_set.packs[i]);
+    }
+    qsort(order, packs, sizeof(char *), compare_pack_sizes);
+
+    char pack_tmp[MAX_PATH_LEN];
+    snprintf(pack_tmp, sizeof(pack_tmp), "%s/tmp-%d.pack", PACK_DIR, (int)getpid());
+    FILE *out = fopen(pack_tmp, "wb");
+    ExtSorter entries;
+    extsort_init(&entries, 1);
+    DictCompressor compressor;
+    compressor_init(&compressor, current_dict(), Z_BEST_COMPRESSION);
+    int count = 0, merged = 0;
+    long offset = 0;
+    for (int p = 0; out && p < packs && (p < 2 || !over_budget(ctx)); p++) {
+        char idx_path[MAX_PATH_LEN];
+        snprintf(idx_path, sizeof(idx_path), "%.*s.idx", (int)(strlen(order[p]) - 5), order[p]);
+        FILE *idx = fopen(idx_path, "r");
+        FILE *in = fopen(order[p], "rb");
+        char line[256];
+        PackedObject obj;
+        while (idx && in && fgets(line, sizeof(line), idx)) {
+            if (!parse_pack_entry(line, &obj)) continue;
+            fseek(in, obj.offset, SEEK_SET);
+            if (!obj.dict[0] && compressor.dict && obj.size <= DICT_OBJECT_MAX) {
+                // Raw small objects from before the dictionary was trained
+                char *data = malloc(obj.size + 1);
+                if (fread(data, 1, obj.size, in) == (size_t)obj.size) {
+                    offset += pack_append(out, &compressor, obj.hash, data, obj.size, offset, &entries);
+                    count++;
+                }
+                free(data);
+                continue;
+            }
+            // Compressed entries keep the dictionary they were written with
+            obj.stored = copy_stream(in, out, obj.stored);
+            char entry[HASH_SIZE + 96];
+            if (obj.dict[0]) {
+                snprintf(entry, sizeof(entry), "%s %ld %ld %ld %s", obj.hash, offset, obj.size, obj.stored, obj.dict);
+            } else {
+                snprintf(entry, sizeof(entry), "%s %ld %ld", obj.hash, offset, obj.stored);
+            }
+            extsort_add(&entries, entry);
+            offset += obj.stored;
+            count++;
+        }
+        if (idx) fclose(idx);
+        if (in) fclose(in);
+        merged++;
+    }
+
+    char name[MAX_PATH_LEN];
+    if (out && count && publish_pack(out, pack_tmp, &entries, name) == 0) {
+        fclose(out);
+        // Readers that loaded the old indexes retry after reloading
+        for (int p = 0; p < merged; p++) {
+            char idx_path[MAX_PATH_LEN];
+            snprintf(idx_path, sizeof(idx_path), "%.*s.idx", (int)(strlen(order[p]) - 5), order[p]);
+            remove(idx_path);
+            remove(order[p]);
+        }
+        printf("  incremental-repack: merged %d packs (%d objects) into %s\n", merged, count, name);
+    } else {
+        if (out) fclose(out);
+        remove(pack_tmp);
+    }
+    for (int i = 0; i < packs; i++) free(order[i]);
+    free(order);
+    compressor_end(&compressor);
+    extsort_free(&entries);
+}
+
+/* Flattens branch logs into "<commit> <tree> <parent> <branch>" lines */
+static void task_commit_graph(MaintenanceContext *ctx) {
+    struct stat graph_st, st;
+    int stale = stat(COMMIT_GRAPH_FILE, &graph_st) != 0;
+    DIR *dir = opendir(BRANCHES_DIR);
+    if (!dir) return;
+    struct dirent *entry;
+    char path[sizeof(BRANCHES_DIR) + MAX_PATH_LEN];
+    while (!stale && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        if (stat(path, &st) == 0 && st.st_mtime >= graph_st.st_mtime) stale = 1;
+    }
+    if (!stale && !ctx->forced) {
+        printf("  commit-graph: up to date\n");
+        closedir(dir);
+        return;
+    }
+
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", COMMIT_GRAPH_FILE, (int)getpid());
+    FILE *graph = fopen(tmp, "w");
+    int commits = 0;
+    rewinddir(dir);
+    while (graph && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".log") != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        FILE *log = fopen(path, "r");
+        if (!log) continue;
+        char line[512], id[64] = "", parent[64] = "-", tree[HASH_SIZE] = "-";
+        while (fgets(line, sizeof(line), log)) {
+            if (strncmp(line, "commit ", 7) == 0) {
+                if (id[0]) {
+                    fprintf(graph, "%s %s %s %.*s\n", id, tree, parent, (int)(len - 4), entry->d_name);
+                    strcpy(parent, id);
+                    commits++;
+                }
+                sscanf(line, "commit %63s", id);
+                strcpy(tree, "-");
+            } else if (strncmp(line, "tree ", 5) == 0) {
+                sscanf(line, "tree %64s", tree);
+            }
+        }
+        if (id[0]) {
+            fprintf(graph, "%s %s %s %.*s\n", id, tree, parent, (int)(len - 4), entry->d_name);
+            commits++;
+        }
+        fclose(log);
+    }
+    closedir(dir);
+    if (graph && fclose(graph) == 0 && rename(tmp, COMMIT_GRAPH_FILE) == 0) {
+        printf("  commit-graph: wrote %d commits\n", commits);
+    } else {
+        remove(tmp);
+    }
+}
+
+/* Drops repeated paths from the staging index, keeping the latest entry */
+static void task_index_compaction(MaintenanceContext *ctx) {
+    (void)ctx;
+    int fd = open(INDEX_FILE, O_RDWR);
+    if (fd < 0) return;
+    flock(fd, LOCK_EX);
+    FILE *index = fdopen(fd, "r+");
+    char **lines = NULL;
+    int count = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), index)) {
+        lines = realloc(lines, sizeof(char *) * (count + 1));
+        lines[count++] = strdup(line);
+    }
+
+    StrMap seen = {0};
+    int kept = 0;
+    char *keep = calloc(count ? count : 1, 1);
+    for (int i = count - 1; i >= 0; i--) {
+        char key[MAX_PATH_LEN];
+        if (sscanf(lines[i], "- %255s :", key) != 1) {
+            snprintf(key, sizeof(key), "%s", lines[i]);
+            key[strcspn(key, "\n")] = 0;
+        }
+        if (strmap_put(&seen, key, NULL)) {
+            keep[i] = 1;
+            kept++;
+        }
+    }
+    if (kept < count) {
+        rewind(index);
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) fputs(lines[i], index);
+        }
+        fflush(index);
+        if (ftruncate(fd, ftell(index)) != 0) perror("ftruncate");
+    }
+    printf("  index-compaction: %d entries, %d duplicates removed\n", count, count - kept);
+
+    for (int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    free(keep);
+    strmap_free(&seen);
+    fclose(index);
+}
+
+/* Returns the number of trees that could not be read */
+static int mark_manifest(StrMap *reachable, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int unreadable = 0;
+    char line[512], filename[MAX_PATH_LEN], hash[HASH_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "- %255s : %64s", filename, hash) == 2) {
+            strmap_put(reachable, hash, NULL);
+        } else if (sscanf(line, "tree %64s", hash) == 1 && strmap_put(reachable, hash, NULL)) {
+            Tree tree = {0};
+            if (read_tree(hash, &tree) != 0) unreadable++;
+            for (int i = 0; i < tree.count; i++) strmap_put(reachable, tree.entries[i].hash, NULL);
+            free_tree(&tree);
+        }
+    }
+    fclose(f);
+    return unreadable;
+}
+
+/* Marks what the refs of the repository in the cwd reach */
+static int mark_refs(StrMap *reachable) {
+    int unreadable = 0;
+    const char *dirs[] = {BRANCHES_DIR, BRANCH_HEADS};
+    for (int d = 0; d < 2; d++) {
+        DIR *dir = opendir(dirs[d]);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            char path[sizeof(BRANCH_HEADS) + MAX_PATH_LEN];
+            // A ref that cannot be named cannot be marked, so it must count
+            if (snprintf(path, sizeof(path), "%s/%s", dirs[d], entry->d_name) >= (int)sizeof(path)) unreadable++;
+            else unreadable += mark_manifest(reachable, path);
+        }
+        if (dir) closedir(dir);
+    }
+    return unreadable + mark_manifest(reachable, INDEX_FILE);
+}
+
+/*
+ * Marks what the repositories borrowing from this one reach, and their
+ * own borrowers in turn. Their trees may live in their own stores, so
+ * each is marked from its root. Returns -1 if one could not be read
+ * completely, in which case gc must not delete anything.
+ */
+static int mark_borrowers(StrMap *reachable, StrMap *seen, int depth) {
+    FILE *f = fopen(BORROWERS_FILE, "r");
+    if (!f) return 0;
+    char **roots = NULL, line[PATH_MAX], here[PATH_MAX];
+    int count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0] || !strmap_put(seen, line, NULL)) continue;
+        roots = realloc(roots, sizeof(char *) * (count + 1));
+        roots[count++] = strdup(line);
+    }
+    fclose(f);
+    int status = getcwd(here, sizeof(here)) ? 0 : -1;
+    for (int i = 0; i < count && status == 0; i++) {
+        if (chdir(roots[i]) != 0 || access(VCS_DIR, F_OK) != 0) {
+            printf("  gc: borrower %s no longer exists\n", roots[i]);
+        } else {
+            unload_packs();
+            forget_repository();
+            if (mark_refs(reachable) > 0 || (depth + 1 < ALTERNATE_DEPTH && mark_borrowers(reachable, seen, depth + 1) != 0)) {
+                printf("  gc: cannot read everything borrower %s reaches\n", roots[i]);
+                status = -1;
+            }
+        }
+        if (chdir(here) != 0) status = -1;
+        unload_packs();
+        forget_repository();
+    }
+    free_names(roots, count);
+    return status;
+}
+
+/*
+ * Removes unreachable loose objects and stale temporaries. Anything younger
+ * than the grace period is kept, since a concurrent commit writes objects
+ * before the log line that references them. Whatever a borrowing
+ * repository reaches counts as reachable here.
+ */
+static void task_gc(MaintenanceContext *ctx) {
+    StrMap reachable = {0}, borrowers = {0};
+    mark_refs(&reachable);
+    int marked = mark_borrowers(&reachable, &borrowers, 0);
+    strmap_free(&borrowers);
+    if (marked != 0) {
+        printf("  gc: skipped, objects borrowed by other repositories could not all be marked\n");
+        strmap_free(&reachable);
+        return;
+    }
+
+    long grace = get_config_long("maintenance.gcGraceSeconds", 3600);
+    time_t cutoff = time(NULL) - grace;
+    int removed = 0, scanned = 0;
+    DIR *dir = opendir(OBJECTS_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL && !over_budget(ctx)) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "pack") == 0 || strcmp(entry->d_name, "info") == 0) {
+            continue;
+        }
+        char path[MAX_PATH_LEN];
+        struct stat st;
+        object_path(entry->d_name, path);
+        if (stat(path, &st) != 0 || st.st_mtime > cutoff) continue;
+        scanned++;
+        if (strchr(entry->d_name, '.') || !strmap_get(&reachable, entry->d_name)) {
+            if (remove(path) == 0) removed++;
+        }
+    }
+    if (dir) closedir(dir);
+    strmap_free(&reachable);
+    printf("  gc: removed %d of %d loose files\n", removed, scanned);
+}
+
+/*
+ * Dictionary training. Small objects are sampled evenly across loose and
+ * packed storage, and every line is counted once per object it appears in.
+ * Lines shared by at least two objects are ranked by the bytes they would
+ * save and the best ones fill the dictionary, the most valuable last:
+ * deflate reaches the end of a dictionary with the shortest distances and
+ * drops its start first when an object is large.
+ */
+typedef struct DictLine {
+    uint64_t hash;
+    long start;
+    int len;
+    int docs;
+    int last_doc;
+} DictLine;
+
+static int compare_dict_lines(const void *a, const void *b) {
+    const DictLine *x = a, *y = b;
+    long sx = (long)(x->docs - 1) * x->len, sy = (long)(y->docs - 1) * y->len;
+    return (sx < sy) - (sx > sy);
+}
+
+#define DICT_SAMPLE_BYTES (16L * 1024 * 1024)
+
+static void task_train_dict(MaintenanceContext *ctx) {
+    long dict_size = get_config_long("maintenance.dictSize", DICT_MAX_SIZE);
+    long max_samples = get_config_long("maintenance.dictSamples", 4096);
+    if (dict_size <= 0 || dict_size > DICT_MAX_SIZE) dict_size = DICT_MAX_SIZE;
+
+    char **names;
+    int count = list_loose_objects(&names);
+    unload_packs();
+    load_packs();
+    names = realloc(names, sizeof(char *) * (count + pack_set.count + 1));
+    for (int i = 0; i < pack_set.count; i++) {
+        if (packed_locally(&pack_set.objects[i])) names[count++] = strdup(pack_set.objects[i].hash);
+    }
+
+    // Samples are concatenated; sample_ends[i] is where object i stops
+    char *samples = NULL;
+    long *sample_ends = malloc(sizeof(long) * (max_samples > 0 ? max_samples : 1));
+    long total = 0, lines = 0;
+    int sampled = 0, stride = count > max_samples && max_samples > 0 ? count / max_samples : 1;
+    for (int i = 0; i < count && sampled < max_samples && total < DICT_SAMPLE_BYTES; i += stride) {
+        if (over_budget(ctx)) break;
+        long size;
+        FILE *f = open_object(names[i], &size);
+        if (!f) continue;
+        if (size > 0 && size <= DICT_OBJECT_MAX) {
+            samples = realloc(samples, total + size);
+            if (fread(samples + total, 1, size, f) == (size_t)size) {
+                for (long j = total; j < total + size; j++) lines += samples[j] == '\n';
+                total += size;
+                sample_ends[sampled++] = total;
+            }
+        }
+        fclose(f);
+    }
+    free_names(names, count);
+    if (sampled < 2) {
+        printf("  train-dict: %d small object(s), too few to train on\n", sampled);
+        free(samples);
+        free(sample_ends);
+        return;
+    }
+
+    size_t capacity = 1024;
+    while (capacity < (size_t)(lines + sampled) * 2) capacity *= 2;
+    DictLine *table = calloc(capacity, sizeof(DictLine));
+    long start = 0;
+    for (int doc = 0; doc < sampled; start = sample_ends[doc++]) {
+        for (long p = start; p < sample_ends[doc];) {
+            const char *nl = memchr(samples + p, '\n', sample_ends[doc] - p);
+            int len = nl ? (int)(nl - samples - p + 1) : (int)(sample_ends[doc] - p);
+            if (len >= 4 && len <= 512) {
+                uint64_t h = 1469598103934665603ULL;
+                for (int k = 0; k < len; k++) h = (h ^ (unsigned char)samples[p + k]) * 1099511628211ULL;
+                size_t slot = h & (capacity - 1);
+                while (table[slot].len && (table[slot].hash != h || table[slot].len != len ||
+                                           memcmp(samples + table[slot].start, samples + p, len) != 0)) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                DictLine *line = &table[slot];
+                if (!line->len) {
+                    line->hash = h;
+                    line->start = p;
+                    line->len = len;
+                    line->last_doc = -1;
+                }
+                if (line->last_doc != doc) {
+                    line->docs++;
+                    line->last_doc = doc;
+                }
+            }
+            p += len;
+        }
+    }
+
+    size_t shared = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        if (table[i].docs >= 2) table[shared++] = table[i];
+    }
+    qsort(table, shared, sizeof(DictLine), compare_dict_lines);
+    size_t chosen = 0;
+    long dict_len = 0;
+    while (chosen < shared && dict_len + table[chosen].len <= dict_size) dict_len += table[chosen++].len;
+    if (dict_len < 64) {
+        printf("  train-dict: samples share too little content for a dictionary\n");
+        free(table);
+        free(samples);
+        free(sample_ends);
+        return;
+    }
+    CompressionDict dict = {{0}, malloc(dict_len), 0, NULL};
+    for (size_t i = chosen; i-- > 0;) {
+        memcpy(dict.data + dict.len, samples + table[i].start, table[i].len);
+        dict.len += table[i].len;
+    }
+    free(table);
+
+    // Measure the samples without and with the dictionary before adopting it
+    DictCompressor plain, trained;
+    compressor_init(&plain, NULL, Z_BEST_COMPRESSION);
+    compressor_init(&trained, &dict, Z_BEST_COMPRESSION);
+    long plain_bytes = 0, trained_bytes = 0;
+    start = 0;
+    for (int doc = 0; doc < sampled; start = sample_ends[doc++]) {
+        long size = sample_ends[doc] - start, n;
+        plain_bytes += (n = compress_object(&plain, samples + start, size)) >= 0 ? n : size;
+        trained_bytes += (n = compress_object(&trained, samples + start, size)) >= 0 ? n : size;
+    }
+    compressor_end(&plain);
+    compressor_end(&trained);
+    free(samples);
+    free(sample_ends);
+
+    char hex[HASH_SIZE], path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    simple_hash_buffer(dict.data, dict.len, hex);
+    snprintf(dict.id, sizeof(dict.id), "%.16s", hex);
+    mkdir(DICT_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/%s", DICT_DIR, dict.id);
+    tmp_object_path(path, tmp);
+    FILE *out = fopen(tmp, "wb");
+    int written = out && fwrite(dict.data, 1, dict.len, out) == (size_t)dict.len;
+    if (out && fclose(out) != 0) written = 0;
+    if (!written || rename(tmp, path) != 0 || set_config("core.compressionDict", dict.id) != 0) {
+        remove(tmp);
+        printf("  train-dict: failed to write %s\n", path);
+        free(dict.data);
+        return;
+    }
+    printf("  train-dict: dictionary %s (%d bytes) from %d objects; samples %ld -> %ld bytes plain, %ld with it\n",
+           dict.id, dict.len, sampled, total, plain_bytes, trained_bytes);
+    free(dict.data);
+}
+
+typedef struct MaintenanceTask {
+    const char *name;
+    void (*run)(MaintenanceContext *ctx);
+    int automatic;
+} MaintenanceTask;
+
+static const MaintenanceTask maintenance_tasks[] = {
+    {"loose-objects", task_loose_objects, 1},
+    {"incremental-repack", task_incremental_repack, 1},
+    {"commit-graph", task_commit_graph, 1},
+    {"index-compaction", task_index_compaction, 1},
+    {"gc", task_gc, 0},
+    {"train-dict", task_train_dict, 0},
+};
+
+void run_maintenance(int argc, char *argv[]) {
+    const int task_count = sizeof(maintenance_tasks) / sizeof(maintenance_tasks[0]);
+    int selected[sizeof(maintenance_tasks) / sizeof(maintenance_tasks[0])] = {0};
+    int any_selected = 0;
+    long budget = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--budget=", 9) == 0) {
+            budget = atol(argv[i] + 9);
+        } else if (strncmp(argv[i], "--task=", 7) == 0) {
+            int t;
+            for (t = 0; t < task_count; t++) {
+                if (strcmp(maintenance_tasks[t].name, argv[i] + 7) == 0) break;
+            }
+            if (t == task_count) {
+                printf("Unknown maintenance task '%s'.\n", argv[i] + 7);
+                return;
+            }
+            selected[t] = 1;
+            any_selected = 1;
+        } else {
+            printf("Usage: vcs maintenance run [--task=<name>]... [--budget=<ms>]\n");
+            return;
+        }
+    }
+
+    // Only one maintenance run at a time; a second one has nothing to add
+    int lock = open(MAINTENANCE_LOCK, O_CREAT | O_RDWR, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        printf("Maintenance is already running.\n");
+        if (lock >= 0) close(lock);
+        return;
+    }
+
+    long start = now_ms();
+    MaintenanceContext ctx = {budget ? start + budget : 0, any_selected};
+    printf("Running maintenance%s:\n", budget ? " (time-budgeted)" : "");
+    for (int t = 0; t < task_count; t++) {
+        if (any_selected ? !selected[t] : !maintenance_tasks[t].automatic) continue;
+        if (over_budget(&ctx)) {
+            printf("  %s: skipped, budget exhausted\n", maintenance_tasks[t].name);
+            continue;
+        }
+        maintenance_tasks[t].run(&ctx);
+    }
+    printf("Maintenance finished in %ld ms.\n", now_ms() - start);
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+/*
+ * One-shot object format migration. Blobs are rehashed in parallel while
+ * being copied under their new names, then trees are rebuilt against the
+ * translation table, journaled, and finally logs, branch heads and the
+ * index are rewritten and the old objects dropped. The table is kept in
+ * .myvcs/hash-map so ids recorded elsewhere can still be translated.
+ */
+typedef struct MigrationJob {
+    char **hashes;
+    char (*mapped)[HASH_SIZE];
+    const HashAlgo *to;
+} MigrationJob;
+
+static void migrate_blob(void *arg, int i) {
+    MigrationJob *job = arg;
+    job->mapped[i][0] = 0;
+    long size;
+    FILE *src = open_object(job->hashes[i], &size);
+    if (!src) return;
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    object_path(job->hashes[i], path);
+    tmp_object_path(path, tmp);
+    FILE *dest = fopen(tmp, "wb");
+    if (!dest) {
+        fclose(src);
+        return;
+    }
+
+    HashCtx ctx;
+    hash_init(&ctx, job->to);
+    unsigned char buf[65536];
+    long left = size;
+    while (left > 0) {
+        size_t n = fread(buf, 1, left < (long)sizeof(buf) ? (size_t)left : sizeof(buf), src);
+        if (n == 0) break;
+        hash_update(&ctx, buf, n);
+        fwrite(buf, 1, n, dest);
+        left -= n;
+    }
+    fclose(src);
+    char hex[HASH_SIZE];
+    hash_final(&ctx, hex);
+    object_path(hex, path);
+    if (fclose(dest) == 0 && left == 0 && rename(tmp, path) == 0) {
+        strcpy(job->mapped[i], hex);
+    } else {
+        remove(tmp);
+    }
+}
+
+/* Rewrites "- <file> : <hash>" and "tree <hash>" lines through the map */
+static int rewrite_hashes(const char *path, const StrMap *map, char *tmp) {
+    FILE *in = fopen(path, "r");
+    if (!in) return -1;
+    snprintf(tmp, MAX_PATH_LEN, "%s.migrate", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    char line[512], filename[MAX_PATH_LEN], hash[HASH_SIZE];
+    while (fgets(line, sizeof(line), in)) {
+        const char *to;
+        if (sscanf(line, "- %255s : %64s", filename, hash) == 2 && (to = strmap_get(map, hash))) {
+            fprintf(out, "- %s : %s\n", filename, to);
+        } else if (sscanf(line, "tree %64s", hash) == 1 && (to = strmap_get(map, hash))) {
+            fprintf(out, "tree %s\n", to);
+        } else {
+            fputs(line, out);
+        }
+    }
+    fclose(in);
+    return fclose(out);
+}
+
+static void collect_ref_files(char ***files, int *count) {
+    const char *dirs[] = {BRANCHES_DIR, BRANCH_HEADS};
+    for (int d = 0; d < 2; d++) {
+        DIR *dir = opendir(dirs[d]);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            char path[sizeof(BRANCH_HEADS) + MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s/%s", dirs[d], entry->d_name) >= (int)sizeof(path)) continue;
+            *files = realloc(*files, sizeof(char *) * (*count + 1));
+            (*files)[(*count)++] = strdup(path);
+        }
+        if (dir) closedir(dir);
+    }
+    *files = realloc(*files, sizeof(char *) * (*count + 1));
+    (*files)[(*count)++] = strdup(INDEX_FILE);
+}
+
+/*
+ * The journal is the migration's commit point: "# <from> -> <to>", the
+ * local packs holding old names as "# pack <path>", then the table. It
+ * is synced before any ref changes, so an interrupted run either left
+ * refs untouched (the new objects are unreferenced garbage) or can be
+ * finished from the journal alone.
+ */
+static int write_migration_journal(const HashAlgo *from, const HashAlgo *to, const StrMap *map) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", MIGRATE_JOURNAL, (int)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "# %s -> %s\n", from->name, to->name);
+    for (int p = 0; p < pack_set.local_packs; p++) fprintf(f, "# pack %s\n", pack_set.packs[p]);
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->keys[i]) fprintf(f, "%s %s\n", map->keys[i], (const char *)map->values[i]);
+    }
+    int failed = fflush(f) != 0 || fsync(fileno(f)) != 0;
+    if (fclose(f) != 0 || failed || rename(tmp, MIGRATE_JOURNAL) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Replays a journal under the maintenance lock. Every step is safe to
+ * repeat: rewriting a ref only touches old ids, and the journal becomes
+ * the hash-map only after the format is flipped and old objects dropped.
+ */
+static int replay_migration_journal(void) {
+    FILE *f = fopen(MIGRATE_JOURNAL, "r");
+    if (!f) return 0;
+    char line[MAX_PATH_LEN + 16], from[32], to[32] = "", old_hash[HASH_SIZE], new_hash[HASH_SIZE];
+    char **packs = NULL;
+    int pack_count = 0;
+    StrMap map = {0};
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "# pack ", 7) == 0) {
+            packs = realloc(packs, sizeof(char *) * (pack_count + 1));
+            packs[pack_count++] = strdup(line + 7);
+        } else if (line[0] == '#') {
+            sscanf(line, "# %31s -> %31s", from, to);
+        } else if (sscanf(line, "%64s %64s", old_hash, new_hash) == 2) {
+            strmap_put(&map, old_hash, new_hash);
+        }
+    }
+    fclose(f);
+    if (!find_hash_algo(to)) {
+        printf("Cannot finish migration: %s names no known object format.\n", MIGRATE_JOURNAL);
+        strmap_free(&map);
+        free_names(packs, pack_count);
+        return -1;
+    }
+
+    char **refs = NULL, tmp[MAX_PATH_LEN];
+    int ref_count = 0;
+    collect_ref_files(&refs, &ref_count);
+    for (int r = 0; r < ref_count; r++) {
+        if (rewrite_hashes(refs[r], &map, tmp) == 0) rename(tmp, refs[r]);
+    }
+    free_names(refs, ref_count);
+    remove(COMMIT_GRAPH_FILE);
+    char version[16];
+    snprintf(version, sizeof(version), "%d", REPO_FORMAT_VERSION);
+    set_config("core.formatVersion", version);
+    set_config("core.objectFormat", to);
+    repo_algo = NULL;
+
+    // Old names are unreferenced now; packs only ever held old names
+    unload_packs();
+    for (size_t i = 0; i < map.capacity; i++) {
+        if (!map.keys[i] || strcmp(map.keys[i], map.values[i]) == 0) continue;
+        char path[MAX_PATH_LEN];
+        object_path(map.keys[i], path);
+        remove(path);
+    }
+    for (int p = 0; p < pack_count; p++) {
+        char idx_path[MAX_PATH_LEN + 8];
+        size_t len = strlen(packs[p]);
+        snprintf(idx_path, sizeof(idx_path), "%.*s.idx", (int)(len > 5 ? len - 5 : 0), packs[p]);
+        remove(idx_path);
+        remove(packs[p]);
+    }
+    free_names(packs, pack_count);
+    strmap_free(&map);
+    return rename(MIGRATE_JOURNAL, HASH_MAP_FILE);
+}
+
+/* Run at startup: completes a migration that was interrupted mid-way */
+int finish_migration(void) {
+    if (access(MIGRATE_JOURNAL, F_OK) != 0) return 0;
+    int lock = open(MAINTENANCE_LOCK, O_CREAT | O_RDWR, 0644);
+    if (lock < 0) return -1;
+    int rc = 0;
+    // A migration still running holds the lock and removes the journal itself
+    if (flock(lock, LOCK_EX) == 0 && access(MIGRATE_JOURNAL, F_OK) == 0) {
+        rc = replay_migration_journal();
+        if (rc == 0) printf("Finished an interrupted object format migration.\n");
+    }
+    close(lock);
+    return rc;
+}
+
+/* Finds a repository listed as a borrower that still exists; its root goes to root */
+static int find_live_borrower(char *root, size_t size) {
+    FILE *f = fopen(BORROWERS_FILE, "r");
+    char line[PATH_MAX], vcs[PATH_MAX + sizeof(VCS_DIR)];
+    int found = 0;
+    while (f && !found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0] || snprintf(vcs, sizeof(vcs), "%s/%s", line, VCS_DIR) >= (int)sizeof(vcs)) continue;
+        if (access(vcs, F_OK) == 0) found = snprintf(root, size, "%s", line) >= 0;
+    }
+    if (f) fclose(f);
+    return found;
+}
+
+void migrate_hash(const char *algo_name, int jobs) {
+    const HashAlgo *from = repo_hash_algo();
+    const HashAlgo *to = find_hash_algo(algo_name);
+    if (!to) {
+        printf("Unknown hash algorithm '%s' (djb2, sha1, sha256, blake3).\n", algo_name);
+        return;
+    }
+    if (to == from) {
+        printf("Repository already uses %s.\n", to->name);
+        return;
+    }
+    if (access(PROMISOR_FILE, F_OK) == 0) {
+        printf("Partial clones cannot be migrated; clone without a filter first.\n");
+        return;
+    }
+    // Borrowed objects keep their old names, and so do the ones borrowers read from here
+    char borrower[PATH_MAX];
+    if (access(ALTERNATES_FILE, F_OK) == 0) {
+        printf("This repository borrows objects (see 'vcs alternates') and cannot be migrated.\n");
+        return;
+    }
+    if (find_live_borrower(borrower, sizeof(borrower))) {
+        printf("'%s' borrows objects from this repository, which therefore cannot be migrated.\n", borrower);
+        return;
+    }
+    int lock = open(MAINTENANCE_LOCK, O_CREAT | O_RDWR, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        printf("Maintenance is running; try again later.\n");
+        if (lock >= 0) close(lock);
+        return;
+    }
+    long start = now_ms();
+
+    // Every object, loose or packed, once; trees are told apart by the logs
+    char **loose;
+    int loose_count = list_loose_objects(&loose);
+    StrMap all = {0}, trees = {0};
+    for (int i = 0; i < loose_count; i++) strmap_put(&all, loose[i], NULL);
+    unload_packs();
+    load_packs();
+    for (int i = 0; i < pack_set.count; i++) strmap_put(&all, pack_set.objects[i].hash, NULL);
+    char **refs = NULL;
+    int ref_count = 0;
+    collect_ref_files(&refs, &ref_count);
+    for (int r = 0; r < ref_count; r++) {
+        FILE *f = fopen(refs[r], "r");
+        char line[512], hash[HASH_SIZE];
+        while (f && fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "tree %64s", hash) == 1) strmap_put(&trees, hash, NULL);
+        }
+        if (f) fclose(f);
+    }
+
+    MigrationJob job = {0};
+    job.to = to;
+    job.hashes = malloc(sizeof(char *) * (all.count + 1));
+    job.mapped = malloc(sizeof(*job.mapped) * (all.count + 1));
+    int blobs = 0;
+    for (size_t i = 0; i < all.capacity; i++) {
+        if (all.keys[i] && !strmap_get(&trees, all.keys[i])) job.hashes[blobs++] = all.keys[i];
+    }
+    parallel_for(blobs, jobs, migrate_blob, &job);
+
+    StrMap map = {0};
+    int failed = 0;
+    for (int i = 0; i < blobs; i++) {
+        if (job.mapped[i][0]) strmap_put(&map, job.hashes[i], job.mapped[i]);
+        else failed++;
+    }
+
+    // From here on new objects are named with the target algorithm
+    repo_algo = to;
+    int tree_count = 0;
+    for (size_t i = 0; i < trees.capacity; i++) {
+        if (!trees.keys[i]) continue;
+        Tree tree = {0};
+        if (read_tree(trees.keys[i], &tree) != 0) {
+            failed++;
+            continue;
+        }
+        for (int e = 0; e < tree.count; e++) {
+            const char *mapped = strmap_get(&map, tree.entries[e].hash);
+            if (mapped) snprintf(tree.entries[e].hash, HASH_SIZE, "%s", mapped);
+        }
+        char hex[HASH_SIZE];
+        write_tree(&tree, hex);
+        strmap_put(&map, trees.keys[i], hex);
+        free_tree(&tree);
+        tree_count++;
+    }
+
+    if (failed) {
+        repo_algo = from;
+        printf("Migration aborted: %d objects could not be rewritten; references unchanged.\n", failed);
+    } else if (write_migration_journal(from, to, &map) != 0) {
+        repo_algo = from;
+        printf("Migration aborted: cannot write %s; references unchanged.\n", MIGRATE_JOURNAL);
+    } else {
+        replay_migration_journal();
+        printf("Migrated %d blobs and %d trees from %s to %s in %ld ms using %d threads.\n",
+               blobs, tree_count, from->name, to->name, now_ms() - start, jobs);
+    }
+
+    for (int r = 0; r < ref_count; r++) free(refs[r]);
+    free(refs);
+    free(job.hashes);
+    free(job.mapped);
+    free_names(loose, loose_count);
+    strmap_free(&all);
+    strmap_free(&trees);
+    strmap_free(&map);
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+static int verify_object(const char *hash) {
+    long size;
+    FILE *f = open_object(hash, &size);
+    if (!f) return -1;
+    io_sequential(fileno(f));
+    HashCtx ctx;
+    hash_init(&ctx, repo_hash_algo());
+    unsigned char buf[65536];
+    long left = size;
+    while (left > 0) {
+        size_t n = fread(buf, 1, left < (long)sizeof(buf) ? (size_t)left : sizeof(buf), f);
+        if (n == 0) break;
+        hash_update(&ctx, buf, n);
+        left -= n;
+    }
+    fclose(f);
+    char hex[HASH_SIZE];
+    hash_final(&ctx, hex);
+    return left == 0 && strcmp(hex, hash) == 0 ? 0 : -1;
+}
+
+static void add_tree_refs(ExtSorter *refs, const char *tree_hash) {
+    long size;
+    FILE *f = open_object(tree_hash, &size);
+    if (!f) return;
+    char line[512], hash[HASH_SIZE], path[MAX_PATH_LEN];
+    long consumed = 0;
+    while (consumed < size && fgets(line, sizeof(line), f)) {
+        consumed += strlen(line);
+        if (sscanf(line, "%64s %255s", hash, path) == 2) extsort_add(refs, hash);
+    }
+    fclose(f);
+}
+
+/*
+ * Checks that every object hashes to its name and that everything the
+ * logs, branch heads, index and trees refer to exists. Objects and
+ * references are both sorted within the memory budget and merge-joined.
+ */
+void fsck(void) {
+    long start = now_ms();
+    ExtSorter objects, refs;
+    extsort_init(&objects, 2);
+    extsort_init(&refs, 2);
+
+    char **loose;
+    int loose_count = list_loose_objects(&loose);
+    for (int i = 0; i < loose_count; i++) extsort_add(&objects, loose[i]);
+    free_names(loose, loose_count);
+    unload_packs();
+    load_packs();
+    for (int i = 0; i < pack_set.count; i++) {
+        if (packed_locally(&pack_set.objects[i])) extsort_add(&objects, pack_set.objects[i].hash);
+    }
+
+    char **files = NULL;
+    int file_count = 0;
+    StrMap trees = {0};
+    collect_ref_files(&files, &file_count);
+    for (int i = 0; i < file_count; i++) {
+        FILE *f = fopen(files[i], "r");
+        char line[512], name[MAX_PATH_LEN], hash[HASH_SIZE];
+        while (f && fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "- %255s : %64s", name, hash) == 2) {
+                extsort_add(&refs, hash);
+            } else if (sscanf(line, "tree %64s", hash) == 1) {
+                extsort_add(&refs, hash);
+                if (strmap_put(&trees, hash, NULL)) add_tree_refs(&refs, hash);
+            }
+        }
+        if (f) fclose(f);
+        free(files[i]);
+    }
+    free(files);
+    strmap_free(&trees);
+    extsort_finish(&objects);
+    extsort_finish(&refs);
+
+    int promisor = access(PROMISOR_FILE, F_OK) == 0, alternates = pack_set.alternate_count;
+    long checked = 0, corrupt = 0, missing = 0, promised = 0, dangling = 0, borrowed = 0;
+    char object[HASH_SIZE] = "", ref[HASH_SIZE] = "";
+    const char *next_object = extsort_next(&objects);
+    const char *next_ref = extsort_next(&refs);
+    while (next_object || next_ref) {
+        int cmp = !next_object ? 1 : !next_ref ? -1 : strcmp(next_object, next_ref);
+        if (cmp <= 0) {
+            snprintf(object, sizeof(object), "%s", next_object);
+            checked++;
+            if (verify_object(object) != 0) {
+                printf(COLOR_RED "corrupt object %s\n" COLOR_RESET, object);
+                corrupt++;
+            }
+            if (cmp < 0) dangling++;
+            while ((next_object = extsort_next(&objects)) != NULL && strcmp(next_object, object) == 0) {}
+            if (cmp == 0) {
+                while ((next_ref = extsort_next(&refs)) != NULL && strcmp(next_ref, object) == 0) {}
+            }
+        } else {
+            snprintf(ref, sizeof(ref), "%s", next_ref);
+            // Borrowed objects are checked by fsck in the store that owns them
+            if (alternates && object_exists(ref)) {
+                borrowed++;
+            } else if (promisor) {
+                promised++;
+            } else {
+                printf(COLOR_RED "missing object %s\n" COLOR_RESET, ref);
+                missing++;
+            }
+            while ((next_ref = extsort_next(&refs)) != NULL && strcmp(next_ref, ref) == 0) {}
+        }
     }
+    int spilled = extsort_spilled(&objects) || extsort_spilled(&refs);
+    extsort_free(&objects);
+    extsort_free(&refs);
+
+    printf("Checked %ld objects in %ld ms%s: %ld corrupt, %ld missing, %ld dangling",
+           checked, now_ms() - start, spilled ? " (spilled to disk)" : "", corrupt, missing, dangling);
+    if (promisor) printf(", %ld on promisor", promised);
+    if (alternates) printf(", %ld borrowed", borrowed);
+    printf(".\n");
+}
+
+#define SIZER_TOP 10
+
+/* Per-branch history and checkout footprint */
+typedef struct BranchSize {
+    char name[MAX_PATH_LEN];
+    long commits;
+    long versions;     // file versions recorded in the log
+    long log_bytes;
+    long tip_files;
+    long tip_bytes;
+    int depth;
+    char deepest[MAX_PATH_LEN];
+} BranchSize;
 
+typedef struct SizedObject {
+    char hash[HASH_SIZE];
+    long size;
+} SizedObject;
+
+typedef struct RevisedPath {
+    char path[MAX_PATH_LEN];
+    long revisions;
+} RevisedPath;
+
+long object_size(const char *hash) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    object_path(hash, path);
+    if (stat(path, &st) == 0) return st.st_size;
+    // Called from sizer's workers, so the pack set may not be read unlocked
+    timed_lock(&pack_lock);
+    const PackedObject *obj = find_packed_object(hash);
+    long size = obj ? obj->size : -1;
+    pthread_mutex_unlock(&pack_lock);
+    return size;
+}
+
+static void size_loose_object(void *arg, int i) {
+    SizedObject *obj = &((SizedObject *)arg)[i];
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    object_path(obj->hash, path);
+    obj->size = stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static void size_branch(void *arg, int i) {
+    BranchSize *b = &((BranchSize *)arg)[i];
+    char path[sizeof(BRANCH_HEADS) + MAX_PATH_LEN + sizeof(".txt")], line[512], name[MAX_PATH_LEN], hash[HASH_SIZE];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s.log", BRANCHES_DIR, b->name);
+    if (stat(path, &st) == 0) b->log_bytes = st.st_size;
     FILE *log = fopen(path, "r");
-    if (!log) return;
+    while (log && fgets(line, sizeof(line), log)) {
+        if (strncmp(line, "commit ", 7) == 0) b->commits++;
+        else if (sscanf(line, "- %255s : %64s", name, hash) == 2) b->versions++;
+    }
+    if (log) fclose(log);
 
-    char line[512], filename[MAX_PATH_LEN], hash[HASH_SIZE];
-    while (fgets(line, sizeof(line), log)) {
-        if (strncmp(line, "- ", 2) == 0) {
-            sscanf(line, "- %s : %s", filename, hash);
-            char obj_path[MAX_PATH_LEN];
-            snprintf(obj_path, sizeof(obj_path), "%s/%s", OBJECTS_DIR, hash);
-            FILE *src = fopen(obj_path, "rb");
-            FILE *dest = fopen(filename, "wb");
-            if (src && dest) {
-                char buf[1024];
-                size_t n;
-                while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-                    fwrite(buf, 1, n, dest);
-                }
-            }
-            if (src) fclose(src);
-            if (dest) fclose(dest);
+    Tree tip = {0};
+    snprintf(path, sizeof(path), "%s/%s.txt", BRANCH_HEADS, b->name);
+    load_manifest(path, &tip);
+    b->tip_files = tip.count;
+    for (int k = 0; k < tip.count; k++) {
+        long size = object_size(tip.entries[k].hash);
+        if (size > 0) b->tip_bytes += size;
+        int depth = 0;
+        for (const char *p = tip.entries[k].path; *p; p++) depth += *p == '/';
+        if (depth > b->depth || !b->deepest[0]) {
+            b->depth = depth;
+            snprintf(b->deepest, sizeof(b->deepest), "%s", tip.entries[k].path);
         }
     }
-    fclose(log);
+    free_tree(&tip);
+}
 
-    FILE *head = fopen(HEAD_FILE, "w");
-    if (head) {
-        fprintf(head, "%s", branch_name);
-        fclose(head);
+/* Keeps the SIZER_TOP largest; top is sorted descending by size */
+static void keep_largest(SizedObject *top, int *count, const char *hash, long size) {
+    if (*count == SIZER_TOP && size <= top[*count - 1].size) return;
+    int i = *count < SIZER_TOP ? (*count)++ : *count - 1;
+    while (i > 0 && top[i - 1].size < size) {
+        top[i] = top[i - 1];
+        i--;
     }
+    snprintf(top[i].hash, sizeof(top[i].hash), "%s", hash);
+    top[i].size = size;
+}
 
-    printf("Switched to branch '%s'\n", branch_name);
+static void keep_most_revised(RevisedPath *top, int *count, const char *path, long revisions) {
+    if (*count == SIZER_TOP && revisions <= top[*count - 1].revisions) return;
+    int i = *count < SIZER_TOP ? (*count)++ : *count - 1;
+    while (i > 0 && top[i - 1].revisions < revisions) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    snprintf(top[i].path, sizeof(top[i].path), "%s", path);
+    top[i].revisions = revisions;
 }
 
-void vcs_revert(const char *commit_id) {
-    char branch[MAX_PATH_LEN];
-    get_current_branch(branch);
+static void format_size(long bytes, char *out, size_t size) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0) snprintf(out, size, "%ld B", bytes);
+    else snprintf(out, size, "%.1f %s", value, units[unit]);
+}
 
-    char log_path[MAX_PATH_LEN];
-    snprintf(log_path, sizeof(log_path), "%s/%s.log", BRANCHES_DIR, branch);
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
 
-    FILE *log = fopen(log_path, "r");
-    if (!log) {
-        printf("Failed to open branch log.\n");
-        return;
+/*
+ * Reports what makes a repository big: object counts, the largest blobs,
+ * the most revised paths and per-branch history. Object sizes and branch
+ * scans run in parallel; path revisions are counted through the sorter,
+ * so memory stays within the budget.
+ */
+void run_sizer(int json) {
+    int jobs = default_jobs();
+
+    // Trees are objects too; keep them out of the blob ranking
+    StrMap trees = {0};
+    ExtSorter paths;
+    extsort_init(&paths, 1);
+    BranchSize *branches = NULL;
+    int branch_count = 0;
+    DIR *dir = opendir(BRANCHES_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".log") != 0) continue;
+        branches = realloc(branches, sizeof(BranchSize) * (branch_count + 1));
+        BranchSize *b = &branches[branch_count++];
+        memset(b, 0, sizeof(*b));
+        snprintf(b->name, sizeof(b->name), "%.*s", (int)(len - 4), entry->d_name);
+
+        char path[MAX_PATH_LEN], line[512], name[MAX_PATH_LEN], hash[HASH_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", BRANCHES_DIR, entry->d_name);
+        FILE *log = fopen(path, "r");
+        while (log && fgets(line, sizeof(line), log)) {
+            if (sscanf(line, "- %255s : %64s", name, hash) == 2) extsort_add(&paths, name);
+            else if (sscanf(line, "tree %64s", hash) == 1) strmap_put(&trees, hash, NULL);
+        }
+        if (log) fclose(log);
     }
+    if (dir) closedir(dir);
+    extsort_finish(&paths);
 
-    char line[512];
-    int found = 0;
+    unload_packs();
+    load_packs();
+    parallel_for(branch_count, jobs, size_branch, branches);
 
-    while (fgets(line, sizeof(line), log)) {
-        if (strncmp(line, "commit", 6) == 0) {
-            char id[64];
-            sscanf(line, "commit %s", id);
-            if (strncmp(id, commit_id, strlen(commit_id)) == 0) {
-                found = 1;
-                break;
+    char **loose;
+    int loose_count = list_loose_objects(&loose);
+    SizedObject *sized = malloc(sizeof(SizedObject) * (loose_count + 1));
+    for (int i = 0; i < loose_count; i++) snprintf(sized[i].hash, sizeof(sized[i].hash), "%s", loose[i]);
+    free_names(loose, loose_count);
+    parallel_for(loose_count, jobs, size_loose_object, sized);
+
+    SizedObject largest[SIZER_TOP];
+    int largest_count = 0;
+    long loose_bytes = 0, packed_bytes = 0, borrowed_bytes = 0;
+    int packed_count = 0;
+    for (int i = 0; i < loose_count; i++) {
+        loose_bytes += sized[i].size;
+        if (!strmap_get(&trees, sized[i].hash)) keep_largest(largest, &largest_count, sized[i].hash, sized[i].size);
+    }
+    for (int i = 0; i < pack_set.count; i++) {
+        const PackedObject *obj = &pack_set.objects[i];
+        if (packed_locally(obj)) {
+            packed_bytes += obj->stored;
+            packed_count++;
+        } else {
+            borrowed_bytes += obj->stored;
+        }
+        if (!strmap_get(&trees, obj->hash)) keep_largest(largest, &largest_count, obj->hash, obj->size);
+    }
+    free(sized);
+    strmap_free(&trees);
+
+    RevisedPath revised[SIZER_TOP];
+    int revised_count = 0;
+    char current[MAX_PATH_LEN] = "";
+    long run = 0;
+    const char *next;
+    while ((next = extsort_next(&paths)) != NULL) {
+        if (strcmp(next, current) != 0) {
+            if (run) keep_most_revised(revised, &revised_count, current, run);
+            snprintf(current, sizeof(current), "%s", next);
+            run = 0;
+        }
+        run++;
+    }
+    if (run) keep_most_revised(revised, &revised_count, current, run);
+    extsort_free(&paths);
+
+    // Name the largest blobs after the last path that recorded them
+    char largest_paths[SIZER_TOP][MAX_PATH_LEN];
+    memset(largest_paths, 0, sizeof(largest_paths));
+    char **files = NULL;
+    int file_count = 0;
+    collect_ref_files(&files, &file_count);
+    for (int f = 0; f < file_count; f++) {
+        FILE *log = fopen(files[f], "r");
+        char line[512], name[MAX_PATH_LEN], hash[HASH_SIZE];
+        while (log && fgets(line, sizeof(line), log)) {
+            if (sscanf(line, "- %255s : %64s", name, hash) != 2) continue;
+            for (int i = 0; i < largest_count; i++) {
+                if (strcmp(largest[i].hash, hash) == 0) snprintf(largest_paths[i], MAX_PATH_LEN, "%s", name);
             }
         }
+        if (log) fclose(log);
+        free(files[f]);
     }
+    free(files);
 
-    if (!found) {
-        printf("Commit ID not found.\n");
-        fclose(log);
-        return;
+    if (json) {
+        printf("{\"objects\": {\"loose\": {\"count\": %d, \"bytes\": %ld}, "
+               "\"packed\": {\"count\": %d, \"bytes\": %ld, \"packs\": %d}, "
+               "\"borrowed\": {\"count\": %d, \"bytes\": %ld, \"alternates\": %d}, \"max_delta_chain\": 0},\n",
+               loose_count, loose_bytes, packed_count, packed_bytes, pack_set.local_packs, pack_set.count - packed_count,
+               borrowed_bytes, pack_set.alternate_count);
+        printf(" \"largest_blobs\": [");
+        for (int i = 0; i < largest_count; i++) {
+            printf("%s{\"hash\": \"%s\", \"size\": %ld, \"path\": ", i ? ", " : "", largest[i].hash, largest[i].size);
+            json_string(largest_paths[i]);
+            printf("}");
+        }
+        printf("],\n \"most_revised\": [");
+        for (int i = 0; i < revised_count; i++) {
+            printf("%s{\"path\": ", i ? ", " : "");
+            json_string(revised[i].path);
+            printf(", \"revisions\": %ld}", revised[i].revisions);
+        }
+        printf("],\n \"branches\": [");
+        for (int i = 0; i < branch_count; i++) {
+            const BranchSize *b = &branches[i];
+            printf("%s\n  {\"name\": ", i ? "," : "");
+            json_string(b->name);
+            printf(", \"commits\": %ld, \"versions\": %ld, \"log_bytes\": %ld, \"tip_files\": %ld, "
+                   "\"tip_bytes\": %ld, \"max_depth\": %d, \"deepest\": ",
+                   b->commits, b->versions, b->log_bytes, b->tip_files, b->tip_bytes, b->depth);
+            json_string(b->deepest);
+            printf("}");
+        }
+        printf("]}\n");
+    } else {
+        char a[32], b[32];
+        format_size(loose_bytes, a, sizeof(a));
+        format_size(packed_bytes, b, sizeof(b));
+        printf("Objects\n");
+        printf("  loose:  %d objects, %s\n", loose_count, a);
+        printf("  packed: %d objects in %d pack(s), %s\n", packed_count, pack_set.local_packs, b);
+        if (pack_set.alternate_count) {
+            format_size(borrowed_bytes, b, sizeof(b));
+            printf("  borrowed: %d packed objects from %d alternate(s), %s\n", pack_set.count - packed_count,
+                   pack_set.alternate_count, b);
+        }
+        printf("  delta chains: none (objects are stored whole)\n");
+        printf("Largest blobs\n");
+        for (int i = 0; i < largest_count; i++) {
+            format_size(largest[i].size, a, sizeof(a));
+            printf("  %10s  %.12s  %s\n", a, largest[i].hash, largest_paths[i]);
+        }
+        printf("Most revised paths\n");
+        for (int i = 0; i < revised_count; i++) printf("  %6ld  %s\n", revised[i].revisions, revised[i].path);
+        printf("Branches\n");
+        for (int i = 0; i < branch_count; i++) {
+            const BranchSize *br = &branches[i];
+            format_size(br->log_bytes, a, sizeof(a));
+            format_size(br->tip_bytes, b, sizeof(b));
+            printf("  %s: %ld commits, %ld file versions, log %s; tip %ld files, %s",
+                   br->name, br->commits, br->versions, a, br->tip_files, b);
+            if (br->deepest[0]) printf(", deepest %s (depth %d)", br->deepest, br->depth);
+            printf("\n");
+        }
     }
+    free(branches);
+}
 
-    fseek(log, 0, SEEK_SET);
-    int inside_target = 0;
-    FILE *index = fopen(INDEX_FILE, "w");
-    if (!index) {
-        printf("Failed to open index.\n");
-        fclose(log);
+/* First line whose path sorts at or after prefix, by binary search over the bytes */
+static const char *tree_seek(const TreeView *v, const char *prefix) {
+    const char *lo = v->data, *hi = v->data + v->size, *end = hi;
+    size_t prefix_len = strlen(prefix);
+    while (lo < hi) {
+        const char *line = lo + (hi - lo) / 2;
+        while (line > lo && line[-1] != '\n') line--;
+        size_t len;
+        const char *path = tree_line_path(line, end, &len);
+        int cmp = memcmp(path, prefix, len < prefix_len ? len : prefix_len);
+        if (cmp < 0 || (cmp == 0 && len < prefix_len)) {
+            const char *nl = memchr(line, '\n', end - line);
+            lo = nl ? nl + 1 : end;
+        } else {
+            hi = line;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Turns a path argument into a root-relative prefix, resolving "." and
+ * ".." against the directory vcs was started in. "dir" and "dir/" both
+ * select everything below dir; "" selects everything.
+ */
+static void normalize_prefix(const char *arg, char *prefix, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", repo.prefix, arg ? arg : "");
+    canonical_path(path, prefix, size);  // climbing above the root stops there
+    size_t len = strlen(prefix);
+    size_t arg_len = arg ? strlen(arg) : 0;
+    if (len && arg_len && arg[arg_len - 1] == '/' && len + 1 < size) strcpy(prefix + len++, "/");
+}
+
+/* Whether path lies at or below prefix */
+static int path_in_prefix(const char *path, size_t len, const char *prefix, size_t prefix_len) {
+    if (len < prefix_len || memcmp(path, prefix, prefix_len) != 0) return 0;
+    return prefix_len == 0 || prefix[prefix_len - 1] == '/' || len == prefix_len || path[prefix_len] == '/';
+}
+
+/*
+ * Lists a commit's or branch's files straight from the mapped tree
+ * object, seeking to <path> by binary search. Without -r only the entries
+ * directly below <path> are shown and deeper directories collapse into
+ * one "tree" line each; trees are flat, so those have no hash of their own.
+ */
+void ls_tree(const char *rev, const char *arg, int recursive) {
+    TreeView v;
+    if (open_tree_view(rev, &v) != 0) {
+        printf("Unknown revision '%s'.\n", rev);
         return;
     }
+    char prefix[PATH_MAX], last_dir[PATH_MAX] = "";
+    normalize_prefix(arg, prefix, sizeof(prefix));
+    size_t prefix_len = strlen(prefix);
+    // Entries directly below a directory start after "dir/"
+    size_t base = prefix_len && prefix[prefix_len - 1] != '/' ? prefix_len + 1 : prefix_len;
 
-    while (fgets(line, sizeof(line), log)) {
-        if (strncmp(line, "commit", 6) == 0) {
-            char id[64];
-            sscanf(line, "commit %s", id);
-            if (strncmp(id, commit_id, strlen(commit_id)) == 0) {
-                inside_target = 1;
-                continue;
-            } else if (inside_target) {
-                break;
+    const char *end = v.data + v.size;
+    for (const char *p = tree_seek(&v, prefix); p < end;) {
+        size_t len;
+        const char *path = tree_line_path(p, end, &len);
+        const char *next = path + len < end ? path + len + 1 : end;
+        if (len < prefix_len || memcmp(path, prefix, prefix_len) != 0) break;
+        if (path_in_prefix(path, len, prefix, prefix_len)) {
+            const char *slash = !recursive && len > base ? memchr(path + base, '/', len - base) : NULL;
+            if (!slash) {
+                printf("blob %.*s\t%.*s\n", (int)(path - 1 - p), p, (int)len, path);
+            } else if ((size_t)(slash - path) != strlen(last_dir) || memcmp(path, last_dir, slash - path) != 0) {
+                snprintf(last_dir, sizeof(last_dir), "%.*s", (int)(slash - path), path);
+                printf("tree -\t%s\n", last_dir);
             }
         }
+        p = next;
+    }
+    close_tree_view(&v);
+}
 
-        if (inside_target && strncmp(line, "- ", 2) == 0) {
-            fputs(line, index);
-            char filename[MAX_PATH_LEN], hash[HASH_SIZE];
-            sscanf(line, "- %s : %s", filename, hash);
-
-            char obj_path[MAX_PATH_LEN];
-            snprintf(obj_path, sizeof(obj_path), "%s/%s", OBJECTS_DIR, hash);
+/*
+ * Lists the files the next commit will contain: the current branch's
+ * tree, mapped as in ls-tree, merged with the paths staged in the index.
+ */
+void ls_files(const char *arg) {
+    char branch[MAX_PATH_LEN], prefix[PATH_MAX];
+    get_current_branch(branch);
+    normalize_prefix(arg, prefix, sizeof(prefix));
+    size_t prefix_len = strlen(prefix);
 
-            FILE *src = fopen(obj_path, "rb");
-            FILE *dest = fopen(filename, "wb");
-            if (src && dest) {
-                char buf[1024];
-                size_t n;
-                while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-                    fwrite(buf, 1, n, dest);
+    ExtSorter staged;
+    extsort_init(&staged, 1);
+    int fd = open(INDEX_FILE, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        const char *index = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (index != MAP_FAILED) {
+            char path[MAX_PATH_LEN];
+            for (const char *p = index, *end = index + st.st_size; p < end;) {
+                const char *nl = memchr(p, '\n', end - p);
+                size_t len = (nl ? nl : end) - p;
+                if (len && len < sizeof(path) && path_in_prefix(p, len, prefix, prefix_len)) {
+                    snprintf(path, sizeof(path), "%.*s", (int)len, p);
+                    extsort_add(&staged, path);
                 }
+                p = nl ? nl + 1 : end;
             }
-            if (src) fclose(src);
-            if (dest) fclose(dest);
+            munmap((void *)index, st.st_size);
         }
     }
+    if (fd >= 0) close(fd);
+    extsort_finish(&staged);
 
-    fclose(index);
-    fclose(log);
+    TreeView v;
+    int have_tree = open_tree_view(branch, &v) == 0;
+    const char *p = have_tree ? tree_seek(&v, prefix) : NULL, *end = have_tree ? v.data + v.size : NULL;
+    const char *next_staged = extsort_next(&staged);
+    char last[MAX_PATH_LEN] = "";
+    for (;;) {
+        size_t len = 0;
+        const char *path = p && p < end ? tree_line_path(p, end, &len) : NULL;
+        if (path && (len < prefix_len || memcmp(path, prefix, prefix_len) != 0)) path = NULL;
+        if (!path && !next_staged) break;
 
-    system("./vcs commit -m \"Revert commit\"");
+        int cmp = !path ? 1 : !next_staged ? -1 : strncmp(path, next_staged, len);
+        if (path && next_staged && cmp == 0 && next_staged[len]) cmp = -1;
+        if (cmp <= 0) {
+            if (path_in_prefix(path, len, prefix, prefix_len)) printf("%.*s\n", (int)len, path);
+            p = path + len < end ? path + len + 1 : end;
+            if (cmp == 0) snprintf(last, sizeof(last), "%s", next_staged);
+        } else if (strcmp(next_staged, last) != 0) {
+            printf("%s\n", next_staged);
+            snprintf(last, sizeof(last), "%s", next_staged);
+        }
+        if (cmp >= 0) next_staged = extsort_next(&staged);
+    }
+    extsort_free(&staged);
+    if (have_tree) close_tree_view(&v);
 }
 
-void vcs_merge(const char *branch_to_merge) {
-    char current_branch[MAX_PATH_LEN];
-    get_current_branch(current_branch);
+#define CAT_FILE_PREFETCH 32
+#define HASH_OBJECT_BATCH 256
 
-    if (strcmp(current_branch, branch_to_merge) == 0) {
-        printf("Cannot merge a branch with itself.\n");
-        return;
+/*
+ * Line reader for the stdin-driven commands. It reads fd 0 directly, so
+ * it can tell lines the client has already sent (and can be queued) from
+ * ones it would have to block for.
+ */
+typedef struct LineReader {
+    char buf[65536];
+    size_t start;
+    size_t end;
+    int eof;
+} LineReader;
+
+/* Next non-empty input line; without wait, returns 0 unless one is already available */
+static int next_line(LineReader *r, int wait, char *line, size_t size) {
+    for (;;) {
+        char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl || (r->eof && r->start < r->end)) {
+            size_t len = (nl ? (size_t)(nl - r->buf) : r->end) - r->start;
+            snprintf(line, size, "%.*s", (int)len, r->buf + r->start);
+            line[strcspn(line, "\r")] = 0;
+            r->start += len + (nl != NULL);
+            if (line[0]) return 1;
+            continue;
+        }
+        if (r->eof) return 0;
+        if (!wait) {
+            struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&p, 1, 0) <= 0) return 0;
+        }
+        if (r->start == r->end || r->end - r->start == sizeof(r->buf)) {
+            r->start = r->end = 0;  // overlong lines are dropped
+        } else if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        ssize_t n = read(STDIN_FILENO, r->buf + r->end, sizeof(r->buf) - r->end);
+        if (n <= 0) r->eof = 1;
+        else r->end += n;
     }
+}
 
-    char current_log_path[MAX_PATH_LEN], merge_log_path[MAX_PATH_LEN];
-    snprintf(current_log_path, sizeof(current_log_path), "%s/%s.log", BRANCHES_DIR, current_branch);
-    snprintf(merge_log_path, sizeof(merge_log_path), "%s/%s.log", BRANCHES_DIR, branch_to_merge);
+static int valid_object_id(const char *id) {
+    if (!*id) return 0;
+    for (const char *p = id; *p; p++) {
+        if (!isalnum((unsigned char)*p)) return 0;
+    }
+    return 1;
+}
 
-    FILE *merge_log = fopen(merge_log_path, "r");
-    if (!merge_log) {
-        printf("Branch '%s' not found.\n", branch_to_merge);
-        return;
+/*
+ * Streams objects named on stdin: "<id> <size>" per id, followed by the
+ * content and a newline with --batch, or "<id> missing". Reads go through
+ * the loose and pack layers. Up to CAT_FILE_PREFETCH ids the client has
+ * already sent are queued: a partial clone fetches their missing objects
+ * from the promisor in one round trip, and the rest are prefetched into
+ * the page cache. Output is flushed whenever the queue runs dry.
+ */
+void cat_file(int contents) {
+    static LineReader reader;
+    char queue[CAT_FILE_PREFETCH][128];
+    int head = 0, count = 0, prefetched = 0;
+    for (;;) {
+        if (count == 0 && !next_line(&reader, 1, queue[head], sizeof(queue[0]))) break;
+        if (count == 0) count = 1;
+        while (count < CAT_FILE_PREFETCH &&
+               next_line(&reader, 0, queue[(head + count) % CAT_FILE_PREFETCH], sizeof(queue[0]))) {
+            count++;
+        }
+        for (int i = prefetched; i < count; i++) {
+            char *id = queue[(head + i) % CAT_FILE_PREFETCH];
+            id[strcspn(id, " \t")] = 0;
+        }
+
+        if (prefetched < count) {
+            char *wanted[CAT_FILE_PREFETCH];
+            int wanted_count = 0;
+            for (int i = prefetched; i < count; i++) {
+                char *id = queue[(head + i) % CAT_FILE_PREFETCH];
+                if (valid_object_id(id)) wanted[wanted_count++] = id;
+            }
+            fetch_missing_objects(wanted, wanted_count);
+            for (int i = 0; i < wanted_count; i++) io_prefetch_object(wanted[i]);
+            prefetched = count;
+        }
+
+        const char *id = queue[head];
+        long size = 0;
+        FILE *f = valid_object_id(id) ? open_object(id, &size) : NULL;
+        if (!f) {
+            printf("%s missing\n", id);
+        } else {
+            printf("%s %ld\n", id, size);
+            char buffer[65536];
+            long left = contents ? size : 0;
+            while (left > 0) {
+                size_t n = fread(buffer, 1, left < (long)sizeof(buffer) ? (size_t)left : sizeof(buffer), f);
+                if (n == 0) break;
+                fwrite(buffer, 1, n, stdout);
+                left -= n;
+            }
+            if (contents) putchar('\n');
+            fclose(f);
+        }
+        head = (head + 1) % CAT_FILE_PREFETCH;
+        count--;
+        prefetched--;
+        if (count == 0) fflush(stdout);
     }
+}
 
-    FILE *index = fopen(INDEX_FILE, "a");
-    if (!index) {
-        printf("Failed to open index for merging.\n");
-        fclose(merge_log);
+typedef struct HashRequest {
+    char path[PATH_MAX];
+    char hash[HASH_SIZE];
+    const char *error;  // printed with the path in place of the hash
+} HashRequest;
+
+typedef struct HashObjectJob {
+    HashRequest *requests;
+    int write;
+} HashObjectJob;
+
+static void hash_request(void *arg, int i) {
+    HashObjectJob *job = arg;
+    HashRequest *req = &job->requests[i];
+    if (req->error) return;
+    struct stat st;
+    STAT_ADD(files_stat, 1);
+    if (stat(req->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        req->error = "error: cannot read '%s'\n";
+        return;
+    }
+    if (hash_file(req->path, req->hash, job->write ? IO_REUSE : IO_ONCE) != 0) {
+        req->error = "error: cannot read '%s'\n";
         return;
     }
+    if (job->write && object_exists(req->hash)) io_drop(req->path);
+    else if (job->write && write_object(req->path, req->hash) != 0) req->error = "error: cannot write '%s'\n";
+}
+
+static void set_hash_request(HashRequest *req, const char *arg) {
+    char path[PATH_MAX];
+    const char *resolved = repo_path(arg, path, sizeof(path));
+    snprintf(req->path, sizeof(req->path), "%s", resolved ? resolved : arg);
+    req->error = resolved ? NULL : "error: '%s' is outside the repository\n";
+}
+
+/* Hashes one batch in parallel and prints the results in request order */
+static void hash_requests(HashRequest *requests, int count, int write) {
+    HashObjectJob job = {requests, write};
+    parallel_for(count, default_jobs(), hash_request, &job);
+    for (int i = 0; i < count; i++) {
+        if (requests[i].error) printf(requests[i].error, requests[i].path);
+        else printf("%s\n", requests[i].hash);
+    }
+    fflush(stdout);
+}
 
-    char line[512];
-    int inside_commit = 0;
-    while (fgets(line, sizeof(line), merge_log)) {
-        if (strncmp(line, "commit", 6) == 0) {
-            inside_commit = 1;
-        } else if (inside_commit && strncmp(line, "- ", 2) == 0) {
-            char filename[MAX_PATH_LEN], hash[HASH_SIZE];
-            sscanf(line, "- %s : %s", filename, hash);
+void hash_objects(char **paths, int count, int write) {
+    HashRequest *requests = malloc(sizeof(HashRequest) * HASH_OBJECT_BATCH);
+    for (int done = 0; done < count; done += HASH_OBJECT_BATCH) {
+        int n = count - done < HASH_OBJECT_BATCH ? count - done : HASH_OBJECT_BATCH;
+        for (int i = 0; i < n; i++) set_hash_request(&requests[i], paths[done + i]);
+        hash_requests(requests, n, write);
+    }
+    free(requests);
+}
 
-            char obj_path[MAX_PATH_LEN];
-            snprintf(obj_path, sizeof(obj_path), "%s/%s", OBJECTS_DIR, hash);
-            FILE *src = fopen(obj_path, "rb");
-            FILE *dest = fopen(filename, "wb");
-            if (src && dest) {
-                char buf[1024];
-                size_t n;
-                while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-                    fwrite(buf, 1, n, dest);
-                }
-            }
-            if (src) fclose(src);
-            if (dest) fclose(dest);
+/*
+ * Hashes the files named on stdin, one path per line, and with -w stores
+ * them as objects. Whatever paths have already arrived, up to
+ * HASH_OBJECT_BATCH, are hashed as one parallel batch, so a client that
+ * feeds paths one at a time still gets each answer right away.
+ */
+void hash_object_paths(int write) {
+    static LineReader reader;
+    HashRequest *requests = malloc(sizeof(HashRequest) * HASH_OBJECT_BATCH);
+    char line[PATH_MAX];
+    while (next_line(&reader, 1, line, sizeof(line))) {
+        int count = 0;
+        do {
+            set_hash_request(&requests[count++], line);
+        } while (count < HASH_OBJECT_BATCH && next_line(&reader, 0, line, sizeof(line)));
+        hash_requests(requests, count, write);
+    }
+    free(requests);
+}
 
-            fprintf(index, "- %s : %s\n", filename, hash);
+static long stats_start_ns = 0;
+static pid_t stats_pid = 0;
+
+/* A field of /proc/self/io, or -1 where the kernel does not provide it */
+static long proc_io(const char *key) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return -1;
+    char line[128];
+    long value = -1;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            value = atol(line + len + 1);
+            break;
         }
     }
+    fclose(f);
+    return value;
+}
 
-    fclose(index);
-    fclose(merge_log);
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-    printf("Merged changes from branch '%s'. Please commit the merge.\n", branch_to_merge);
+/* Printed at exit for --stats, on stderr so command output stays parseable */
+static void print_stats(void) {
+    if (getpid() != stats_pid) return;  // forked promisor servers exit too
+    fflush(stdout);
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    char a[32], b[32], c[32], d[32];
+
+    fprintf(stderr, "--- stats ---\n");
+    fprintf(stderr, "time:     %.3f s wall, %.3f s user, %.3f s sys (hooks/children %.3f s user, %.3f s sys)\n",
+            (monotonic_ns() - stats_start_ns) / 1e9, seconds(self.ru_utime), seconds(self.ru_stime),
+            seconds(children.ru_utime), seconds(children.ru_stime));
+    if (stats.first_output_ns) {
+        fprintf(stderr, "latency:  first output after %.3f ms\n", (stats.first_output_ns - stats_start_ns) / 1e6);
+    }
+    format_size(self.ru_maxrss * 1024, a, sizeof(a));
+    fprintf(stderr, "memory:   %s peak RSS, %ld major / %ld minor page faults\n", a, self.ru_majflt, self.ru_minflt);
+
+    long rchar = proc_io("rchar"), wchar = proc_io("wchar");
+    if (rchar >= 0) {
+        format_size(rchar, a, sizeof(a));
+        format_size(wchar, b, sizeof(b));
+        format_size(proc_io("read_bytes"), c, sizeof(c));
+        format_size(proc_io("write_bytes"), d, sizeof(d));
+        fprintf(stderr, "io:       %s read, %s written (%s from disk, %s to disk)\n", a, b, c, d);
+        fprintf(stderr, "syscalls: %ld read, %ld write\n", proc_io("syscr"), proc_io("syscw"));
+    }
+
+    format_size(stats.bytes_hashed, a, sizeof(a));
+    fprintf(stderr, "files:    %ld stat'd, %ld opened, %ld hashed (%s)\n",
+            stats.files_stat, stats.files_opened, stats.files_hashed, a);
+    long lookups = stats.loose_hits + stats.pack_hits + stats.object_misses;
+    fprintf(stderr, "objects:  %ld written, %ld fetched; %ld lookups, %ld loose, %ld packed, %ld missing",
+            stats.objects_written, stats.objects_fetched, lookups, stats.loose_hits, stats.pack_hits, stats.object_misses);
+    if (lookups) fprintf(stderr, " (%.1f%% hit)", 100.0 * (lookups - stats.object_misses) / lookups);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "caches:   %ld pack index load(s), %ld sort spill(s)\n", stats.pack_loads, stats.sort_spills);
+    if (stats.parallel_tasks) {
+        fprintf(stderr, "threads:  %d worker(s), %ld task(s), %.1f%% busy, largest batch %ld, %ld lock wait(s) %.3f ms\n",
+                default_jobs(), stats.parallel_tasks,
+                stats.parallel_capacity_ns ? 100.0 * stats.parallel_busy_ns / stats.parallel_capacity_ns : 0.0,
+                stats.parallel_largest_batch, stats.lock_waits, stats.lock_wait_ns / 1e6);
+    }
 }
 
 void show_help() {
+    printf("Usage: vcs [--memory-limit=<size>] [--threads=<n>] [--stats] <command> [args]\n");
     printf("Available commands:\n");
     printf("  init              Initialize a new repository\n");
     printf("  add <file>        Add file to staging area\n");
-    printf("  commit <msg>      Commit staged files with message\n");
+    printf("  commit [--no-verify] <msg>\n");
+    printf("                    Commit staged files with message; --no-verify skips hooks\n");
     printf("  status            Show status of working directory\n");
     printf("  log               Show commit history\n");
     printf("  branch <name>     Create a new branch\n");
@@ -535,20 +6718,118 @@ void show_help() {
     printf("  help              Show this help message\n");
     printf("  revert            To jump to previous version give commit id\n");
     printf("  merge             To merge branches\n");
+    printf("  clone [--filter=blob:none|blob:limit=<n>|--shared] <src> <dir>\n");
+    printf("                    Clone a local repository, optionally without blobs\n");
+    printf("  alternates [add <repository>]\n");
+    printf("                    List or add the object stores this repository borrows from\n");
+    printf("  maintenance run [--task=<name>] [--budget=<ms>]\n");
+    printf("                    Pack loose objects, write the commit graph, compact\n");
+    printf("                    the index; gc only when asked for by name\n");
+    printf("  maintenance train-dict [--budget=<ms>]\n");
+    printf("                    Train a compression dictionary from small objects\n");
+    printf("  migrate-hash <algo> [--jobs=<n>]\n");
+    printf("                    Rewrite all objects with djb2, sha1, sha256 or blake3\n");
+    printf("  diff <a> <b> [--stat|--name-status]\n");
+    printf("                    Compare two commits or branches\n");
+    printf("  format-patch <from>..<to>|<commit>\n");
+    printf("                    Print commits of the current branch as patches\n");
+    printf("  apply [--check] <patch>\n");
+    printf("                    Apply a unified diff or patch series to the working tree\n");
+    printf("  sizer [--json]    Report object counts, largest blobs, hot paths and branch sizes\n");
+    printf("  fsck              Verify object hashes and that referenced objects exist\n");
+    printf("  cat-file --batch|--batch-check\n");
+    printf("                    Print the size (and content) of each object id read from stdin\n");
+    printf("  hash-object [-w] --stdin-paths | <file>...\n");
+    printf("                    Hash (and with -w store) each file, printing hashes in input order\n");
+    printf("  ls-files [<path>] List tracked and staged files\n");
+    printf("  ls-tree [-r] <commit|branch> [<path>]\n");
+    printf("                    List a snapshot's files; -r descends into directories\n");
+    printf("  batch [-z]        Run commands read from stdin in one process, each\n");
+    printf("                    response followed by \"end <n>\" (NUL with -z)\n");
+    printf("  mount <rev> <dir> Mount a commit or branch read-only (FUSE builds)\n");
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: vcs <command> [args]\n");
-        return 1;
+int run_command(int argc, char *argv[]);
+
+#define BATCH_MAX_ARGS 64
+
+/* Commands that return and leave stdin, the command stream, to the batch */
+static const char *batch_commands[] = {
+    "add", "commit", "status", "log", "branch", "checkout", "revert", "help", "merge", "diff", "format-patch",
+    "apply", "ls-files", "ls-tree", "hash-object", "sizer", "fsck", "alternates", "maintenance", NULL,
+};
+
+static int batch_allows(int argc, char *args[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(args[i], "-") == 0 || strcmp(args[i], "--stdin-paths") == 0) return 0;
+    }
+    for (int i = 0; batch_commands[i]; i++) {
+        if (strcmp(args[1], batch_commands[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Runs commands read from stdin in this one process, so the repository,
+ * config and pack indexes are loaded once for the whole stream. Commands
+ * come one per line with whitespace-separated arguments, or with -z as
+ * NUL-terminated arguments closed by an empty one. Every response ends
+ * with an "end <n>" line (a NUL byte with -z) and is flushed at once.
+ */
+void run_batch(int nul) {
+    char *args[BATCH_MAX_ARGS + 2] = {"vcs"};
+    char *line = NULL;
+    size_t capacity = 0;
+    int argc = 1, sequence = 0, dropped = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &capacity, nul ? '\0' : '\n', stdin)) > 0) {
+        if (nul) {
+            if (line[0] && argc <= BATCH_MAX_ARGS) args[argc++] = strdup(line);
+            else if (line[0]) dropped++;
+            if (line[0]) continue;  // an empty argument ends the command
+        } else {
+            line[strcspn(line, "\r\n")] = 0;
+            for (char *save, *arg = strtok_r(line, " \t", &save); arg; arg = strtok_r(NULL, " \t", &save)) {
+                if (argc <= BATCH_MAX_ARGS) args[argc++] = strdup(arg);
+                else dropped++;
+            }
+        }
+        if (argc == 1) continue;
+
+        args[argc] = NULL;
+        sequence++;
+        // Running what fits would quietly do less than was asked
+        if (dropped) {
+            printf("'%s' has more than %d arguments; not run.\n", args[1], BATCH_MAX_ARGS);
+        } else if (!batch_allows(argc, args)) {
+            printf("'%s' is not available in batch mode.\n", args[1]);
+        } else {
+            run_command(argc, args);
+        }
+        if (nul) putchar('\0');
+        else printf("end %d\n", sequence);
+        fflush(stdout);
+        while (argc > 1) free(args[--argc]);
+        dropped = 0;
     }
+    free(line);
+}
+
+/* Dispatches one command; argv[1] is the command name as on the command line */
+int run_command(int argc, char *argv[]) {
+    char arg_path[PATH_MAX];
 
     if (strcmp(argv[1], "init") == 0) {
         init_repo();
     } else if (strcmp(argv[1], "add") == 0 && argc == 3) {
-        add_file(argv[2]);
+        const char *path = repo_path(argv[2], arg_path, sizeof(arg_path));
+        if (!path || path[0] == '/') printf("'%s' is outside the repository.\n", argv[2]);
+        else if (!path[0]) printf("'%s' is the repository root, not a file.\n", argv[2]);
+        else add_file(path);
     } else if (strcmp(argv[1], "commit") == 0 && argc == 3) {
-        commit(argv[2]);
+        commit(argv[2], 1);
+    } else if (strcmp(argv[1], "commit") == 0 && argc == 4 && strcmp(argv[2], "--no-verify") == 0) {
+        commit(argv[3], 0);
     } else if (strcmp(argv[1], "status") == 0) {
         show_status();
     } else if (strcmp(argv[1], "log") == 0) {
@@ -563,8 +6844,98 @@ int main(int argc, char *argv[]) {
         show_help();
     } else if (strcmp(argv[1], "merge") == 0 && argc == 3) {
         vcs_merge(argv[2]);
+    } else if (strcmp(argv[1], "clone") == 0 && argc == 4) {
+        clone_repo(argv[2], argv[3], NULL, 0);
+    } else if (strcmp(argv[1], "clone") == 0 && argc == 5 && strncmp(argv[2], "--filter=", 9) == 0) {
+        clone_repo(argv[3], argv[4], argv[2] + 9, 0);
+    } else if (strcmp(argv[1], "clone") == 0 && argc == 5 && strcmp(argv[2], "--shared") == 0) {
+        clone_repo(argv[3], argv[4], NULL, 1);
+    } else if (strcmp(argv[1], "alternates") == 0 && (argc == 2 || (argc == 4 && strcmp(argv[2], "add") == 0))) {
+        alternates_command(argc == 4 ? argv[3] : NULL);
+    } else if (strcmp(argv[1], "maintenance") == 0 && argc >= 3 && strcmp(argv[2], "run") == 0) {
+        run_maintenance(argc - 3, argv + 3);
+    } else if (strcmp(argv[1], "maintenance") == 0 && argc >= 3 && argc <= 4 && strcmp(argv[2], "train-dict") == 0) {
+        char *args[] = {"--task=train-dict", argc == 4 ? argv[3] : NULL};
+        run_maintenance(argc - 2, args);
+    } else if (strcmp(argv[1], "migrate-hash") == 0 && (argc == 3 || argc == 4)) {
+        int jobs = default_jobs();
+        if (argc == 4 && strncmp(argv[3], "--jobs=", 7) == 0) jobs = atoi(argv[3] + 7);
+        migrate_hash(argv[2], jobs > 0 ? jobs : 1);
+    } else if (strcmp(argv[1], "diff") == 0 && (argc == 4 || argc == 5)) {
+        int mode = DIFF_PATCH;
+        if (argc == 5 && strcmp(argv[4], "--stat") == 0) mode = DIFF_STAT;
+        else if (argc == 5 && strcmp(argv[4], "--name-status") == 0) mode = DIFF_NAME_STATUS;
+        else if (argc == 5) printf("Unknown diff option '%s'.\n", argv[4]);
+        if (argc == 4 || mode != DIFF_PATCH) diff_commits(argv[2], argv[3], mode);
+    } else if (strcmp(argv[1], "format-patch") == 0 && argc == 3) {
+        format_patch(argv[2]);
+    } else if (strcmp(argv[1], "apply") == 0 && (argc == 3 || (argc == 4 && strcmp(argv[2], "--check") == 0))) {
+        const char *patch = strcmp(argv[argc - 1], "-") ? repo_path(argv[argc - 1], arg_path, sizeof(arg_path)) : "-";
+        if (patch) apply_patch(patch, argc == 4);
+        else printf("'%s' is outside the repository.\n", argv[argc - 1]);
+    } else if (strcmp(argv[1], "sizer") == 0 && (argc == 2 || (argc == 3 && strcmp(argv[2], "--json") == 0))) {
+        run_sizer(argc == 3);
+    } else if (strcmp(argv[1], "fsck") == 0) {
+        fsck();
+    } else if (strcmp(argv[1], "mount") == 0 && argc == 4) {
+        const char *mountpoint = repo_path(argv[3], arg_path, sizeof(arg_path));
+        if (mountpoint) mount_commit(argv[2], mountpoint[0] ? mountpoint : ".");
+        else printf("'%s' is outside the repository.\n", argv[3]);
+    } else if (strcmp(argv[1], "cat-file") == 0 && argc == 3 &&
+               (strcmp(argv[2], "--batch") == 0 || strcmp(argv[2], "--batch-check") == 0)) {
+        cat_file(strcmp(argv[2], "--batch") == 0);
+    } else if (strcmp(argv[1], "hash-object") == 0 && argc >= 3) {
+        int write = strcmp(argv[2], "-w") == 0;
+        if (argc == 3 + write && strcmp(argv[2 + write], "--stdin-paths") == 0) hash_object_paths(write);
+        else if (argc > 2 + write) hash_objects(argv + 2 + write, argc - 2 - write, write);
+        else printf("Usage: vcs hash-object [-w] --stdin-paths | <file>...\n");
+    } else if (strcmp(argv[1], "ls-files") == 0 && argc <= 3) {
+        ls_files(argc == 3 ? argv[2] : NULL);
+    } else if (strcmp(argv[1], "ls-tree") == 0 && argc >= 3 && argc <= 5) {
+        int recursive = strcmp(argv[2], "-r") == 0;
+        if (argc > 2 + recursive) ls_tree(argv[2 + recursive], argc > 3 + recursive ? argv[3 + recursive] : NULL, recursive);
+        else printf("Usage: vcs ls-tree [-r] <commit|branch> [<path>]\n");
+    } else if (strcmp(argv[1], "batch") == 0 && (argc == 2 || (argc == 3 && strcmp(argv[2], "-z") == 0))) {
+        run_batch(argc == 3);
     } else {
         printf("Invalid command. Use 'vcs help' for available commands.\n");
+        return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    // Global options come before the command
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strncmp(argv[1], "--memory-limit=", 15) == 0) {
+            memory_limit = (long)parse_size(argv[1] + 15);
+        } else if (strncmp(argv[1], "--threads=", 10) == 0) {
+            thread_override = atoi(argv[1] + 10);
+        } else if (strcmp(argv[1], "--stats") == 0) {
+            stats_start_ns = monotonic_ns();
+            stats_pid = getpid();
+            atexit(print_stats);
+        } else {
+            printf("Unknown option '%s'.\n", argv[1]);
+            return 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2) {
+        printf("Usage: vcs [--memory-limit=<size>] [--threads=<n>] [--stats] <command> [args]\n");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "init") != 0 && strcmp(argv[1], "clone") != 0 && strcmp(argv[1], "help") != 0) {
+        if (discover_repository() != 0) {
+            printf("Not a vcs repository (or any parent directory).\n");
+            return 1;
+        }
+        if (check_repository_format() != 0 || finish_migration() != 0) return 1;
+        io_policy_init();
+    }
+    return run_command(argc, argv);
+}
@@ -0,0 +1,220 @@
+/*
+ * Compares two result sets written by tools/bench. For every operation in
+ * both files it reports the medians, a bootstrap 95% confidence interval
+ * for the change of the median and a Mann-Whitney U test. An operation is
+ * a regression when the test is significant, the interval excludes zero
+ * and the slowdown exceeds the threshold; the exit status is 1 if any
+ * operation regressed.
+ *
+ *   bench-compare [--alpha <p>] [--threshold <percent>] <base.json> <new.json>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define BOOTSTRAP_ROUNDS 2000
+
+typedef struct Series {
+    char op[128];
+    double *samples;
+    int count;
+} Series;
+
+typedef struct ResultSet {
+    Series *series;
+    int count;
+} ResultSet;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t len = 0, cap = 65536;
+    char *data = malloc(cap);
+    size_t n;
+    while ((n = fread(data + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (cap - len < 2) data = realloc(data, cap *= 2);
+    }
+    fclose(f);
+    data[len] = 0;
+    return data;
+}
+
+/*
+ * Reads {"op": "<name>", "samples": [...]} objects in document order.
+ * Other keys are ignored, so newer bench output stays comparable.
+ */
+static int load_results(const char *path, ResultSet *set) {
+    char *data = read_file(path);
+    if (!data) {
+        perror(path);
+        return -1;
+    }
+    memset(set, 0, sizeof(*set));
+    for (char *p = strstr(data, "\"op\""); p; p = strstr(p, "\"op\"")) {
+        char *name = strchr(p + 4, '"');
+        char *end = name ? strchr(name + 1, '"') : NULL;
+        char *samples = end ? strstr(end, "\"samples\"") : NULL;
+        char *open = samples ? strchr(samples, '[') : NULL;
+        if (!open) break;
+
+        set->series = realloc(set->series, sizeof(Series) * (set->count + 1));
+        Series *s = &set->series[set->count++];
+        memset(s, 0, sizeof(*s));
+        snprintf(s->op, sizeof(s->op), "%.*s", (int)(end - name - 1), name + 1);
+        int cap = 0;
+        char *q = open + 1;
+        for (;;) {
+            while (*q == ' ' || *q == ',' || *q == '\n' || *q == '\t' || *q == '\r') q++;
+            if (*q == ']' || *q == 0) break;
+            char *next;
+            double value = strtod(q, &next);
+            if (next == q) break;
+            if (s->count == cap) s->samples = realloc(s->samples, sizeof(double) * (cap = cap ? cap * 2 : 16));
+            s->samples[s->count++] = value;
+            q = next;
+        }
+        p = q;
+    }
+    free(data);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(const double *values, int count) {
+    double *sorted = malloc(sizeof(double) * count);
+    memcpy(sorted, values, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    double m = count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+    free(sorted);
+    return m;
+}
+
+/* Two-sided p-value of the Mann-Whitney U test, normal approximation with tie correction */
+static double mann_whitney(const double *a, int n1, const double *b, int n2) {
+    int n = n1 + n2;
+    double (*all)[2] = malloc(sizeof(*all) * n);
+    for (int i = 0; i < n1; i++) {
+        all[i][0] = a[i];
+        all[i][1] = 0;
+    }
+    for (int i = 0; i < n2; i++) {
+        all[n1 + i][0] = b[i];
+        all[n1 + i][1] = 1;
+    }
+    qsort(all, n, sizeof(*all), compare_doubles);
+
+    double rank_sum = 0, ties = 0;
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && all[j][0] == all[i][0]) j++;
+        double rank = (i + j + 1) / 2.0;  // average of ranks i+1..j
+        for (int k = i; k < j; k++) {
+            if (all[k][1] == 0) rank_sum += rank;
+        }
+        double t = j - i;
+        ties += t * t * t - t;
+        i = j;
+    }
+    free(all);
+
+    double u = rank_sum - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * (double)n2 / 2;
+    double var = n1 * (double)n2 / 12 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (var <= 0) return 1;
+    double z = (fabs(u - mean) - 0.5) / sqrt(var);
+    if (z < 0) z = 0;
+    return erfc(z / sqrt(2));
+}
+
+/* 95% bootstrap interval of the relative change between the medians */
+static void bootstrap_change(const double *a, int n1, const double *b, int n2, double *low, double *high) {
+    double *changes = malloc(sizeof(double) * BOOTSTRAP_ROUNDS);
+    double *ra = malloc(sizeof(double) * n1), *rb = malloc(sizeof(double) * n2);
+    for (int r = 0; r < BOOTSTRAP_ROUNDS; r++) {
+        for (int i = 0; i < n1; i++) ra[i] = a[next_random() % n1];
+        for (int i = 0; i < n2; i++) rb[i] = b[next_random() % n2];
+        double base = median(ra, n1);
+        changes[r] = base > 0 ? median(rb, n2) / base - 1 : 0;
+    }
+    qsort(changes, BOOTSTRAP_ROUNDS, sizeof(double), compare_doubles);
+    *low = changes[(int)(BOOTSTRAP_ROUNDS * 0.025)];
+    *high = changes[(int)(BOOTSTRAP_ROUNDS * 0.975)];
+    free(changes);
+    free(ra);
+    free(rb);
+}
+
+int main(int argc, char *argv[]) {
+    double alpha = 0.05, threshold = 5;
+    const char *paths[2] = {NULL, NULL};
+    int path_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) alpha = atof(argv[++i]);
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) threshold = atof(argv[++i]);
+        else if (path_count < 2 && argv[i][0] != '-') paths[path_count++] = argv[i];
+        else path_count = 3;
+    }
+    if (path_count != 2) {
+        fprintf(stderr, "usage: bench-compare [--alpha <p>] [--threshold <percent>] <base.json> <new.json>\n");
+        return 2;
+    }
+
+    ResultSet base, next;
+    if (load_results(paths[0], &base) != 0 || load_results(paths[1], &next) != 0) return 2;
+
+    int regressions = 0, compared = 0;
+    printf("%-24s %12s %12s %9s %20s %8s  %s\n", "operation", "base", "new", "change", "95% CI", "p", "verdict");
+    for (int i = 0; i < base.count; i++) {
+        const Series *a = &base.series[i], *b = NULL;
+        for (int j = 0; j < next.count && !b; j++) {
+            if (strcmp(next.series[j].op, a->op) == 0) b = &next.series[j];
+        }
+        if (!b || a->count == 0 || b->count == 0) {
+            printf("%-24s (missing from %s)\n", a->op, b ? "a sample set" : paths[1]);
+            continue;
+        }
+        compared++;
+        double ma = median(a->samples, a->count), mb = median(b->samples, b->count);
+        double change = ma > 0 ? mb / ma - 1 : 0, low, high;
+        bootstrap_change(a->samples, a->count, b->samples, b->count, &low, &high);
+        double p = mann_whitney(a->samples, a->count, b->samples, b->count);
+
+        const char *verdict = "~";
+        if (p < alpha && low > 0 && change * 100 > threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (p < alpha && high < 0 && change * 100 < -threshold) {
+            verdict = "improved";
+        }
+        char interval[48];
+        snprintf(interval, sizeof(interval), "[%+.1f%%, %+.1f%%]", low * 100, high * 100);
+        printf("%-24s %9.3f ms %9.3f ms %+8.1f%% %20s %8.4f  %s\n", a->op, ma * 1000, mb * 1000, change * 100,
+               interval, p, verdict);
+    }
+    for (int i = 0; i < base.count; i++) {
+        if (base.series[i].count < 5) {
+            fprintf(stderr, "note: fewer than 5 samples per operation rarely reach significance\n");
+            break;
+        }
+    }
+    printf("%d operation(s) compared, %d regression(s) beyond %.1f%% at alpha %.3f\n", compared, regressions,
+           threshold, alpha);
+    return regressions ? 1 : 0;
+}
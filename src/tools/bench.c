@@ -0,0 +1,423 @@
+/*
+ * Benchmark driver for vcs. Builds a synthetic repository in a temp
+ * directory, runs each operation for a number of trials and writes the
+ * wall-clock samples as JSON for tools/bench-compare.
+ *
+ *   bench [--vcs <path>] [--files <n>] [--size <bytes>] [--trials <n>] [--out <file>]
+ *         [--cache warm|cold|both] [--dir <path>] [--scaling [--max-threads <n>]] [--perf <dir>]
+ *
+ * Cold samples drop the repository, working files and object store from
+ * the page cache before every trial and are reported as "<op>/cold";
+ * warm samples keep the operation's plain name. Eviction has no effect on
+ * tmpfs, so --dir can place the repository on a disk-backed filesystem.
+ * --scaling runs the threaded operations with warm caches at 1, 2, 4, ...
+ * max threads and adds speedup, efficiency and the contention figures
+ * from vcs --stats.
+ * Streaming operations (status, log, diff) also report the time until
+ * their first byte reaches stdout as "<op>/ttfb", which is what an
+ * interactive user waits for.
+ * --perf records the last trial of every run with perf record -g, ready
+ * for flame graph tooling.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+typedef struct Options {
+    char vcs[PATH_MAX];
+    int files;
+    int size;
+    int trials;
+    const char *out;
+    int warm;
+    int cold;
+    char dir[PATH_MAX];
+    int scaling;
+    int max_threads;
+    char perf_dir[PATH_MAX];
+} Options;
+
+/* One benchmarked command; prepare runs untimed before every trial */
+typedef struct Operation {
+    const char *name;
+    void (*prepare)(const Options *opt, int trial);
+    int threaded;
+    int streams;
+    const char *args[5];  // NULL-terminated
+} Operation;
+
+/* Parallel section figures parsed from the --stats report, summed over trials */
+typedef struct Contention {
+    double busy_pct;
+    double lock_wait_ms;
+    long lock_waits;
+    long largest_batch;
+    int reports;
+} Contention;
+
+static char first_commit[64] = "";
+static char migrate_target[16] = "blake3";
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void parse_contention(FILE *report, Contention *c) {
+    char line[512];
+    while (fgets(line, sizeof(line), report)) {
+        int workers;
+        long tasks, batch, waits;
+        double busy, wait_ms;
+        if (sscanf(line, "threads: %d worker(s), %ld task(s), %lf%% busy, largest batch %ld, %ld lock wait(s) %lf ms",
+                   &workers, &tasks, &busy, &batch, &waits, &wait_ms) == 6) {
+            c->busy_pct += busy;
+            c->lock_wait_ms += wait_ms;
+            c->lock_waits += waits;
+            if (batch > c->largest_batch) c->largest_batch = batch;
+            c->reports++;
+        }
+    }
+}
+
+/* Page cache residency of the files under the repository, for checking eviction */
+static long resident_pages, total_pages;
+
+static int evict_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st->st_size + page - 1) / page;
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vec = malloc(pages);
+    if (map != MAP_FAILED && vec && mincore(map, st->st_size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++) resident_pages += vec[i] & 1;
+        total_pages += pages;
+    }
+    free(vec);
+    if (map != MAP_FAILED) munmap(map, st->st_size);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Drops everything under the current directory from the page cache. Dirty
+ * pages cannot be dropped, so the trial's prepare step is synced first.
+ * Returns the fraction of pages still resident afterwards.
+ */
+static double evict_caches(void) {
+    sync();
+    resident_pages = total_pages = 0;
+    nftw(".", evict_file, 32, FTW_PHYS);
+    return total_pages ? (double)resident_pages / total_pages : 0;
+}
+
+/*
+ * Runs vcs with its output discarded and returns the wall time in seconds.
+ * threads > 0 pins the worker count and collects contention figures;
+ * perf_data wraps the run in perf record. first_output, when given, reads
+ * stdout through a pipe and receives the time until its first byte.
+ */
+static double run_vcs(const Options *opt, const char *const args[], int threads, const char *perf_data,
+                      Contention *contention, double *first_output) {
+    const char *argv[16];
+    char threads_arg[32];
+    int argc = 0;
+    if (perf_data) {
+        const char *perf[] = {"perf", "record", "-g", "-q", "-o", perf_data, "--"};
+        for (int i = 0; i < 7; i++) argv[argc++] = perf[i];
+    }
+    argv[argc++] = opt->vcs;
+    if (threads > 0) {
+        snprintf(threads_arg, sizeof(threads_arg), "--threads=%d", threads);
+        argv[argc++] = "--stats";
+        argv[argc++] = threads_arg;
+    }
+    for (int i = 0; args[i] && argc < 15; i++) argv[argc++] = args[i];
+    argv[argc] = NULL;
+
+    FILE *report = contention ? tmpfile() : NULL;
+    int out[2] = {-1, -1};
+    if (first_output && pipe(out) != 0) first_output = NULL;
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (first_output) {
+            dup2(out[1], STDOUT_FILENO);
+            close(out[0]);
+            close(out[1]);
+        } else if (null >= 0) dup2(null, STDOUT_FILENO);
+        if (report) dup2(fileno(report), STDERR_FILENO);
+        else if (null >= 0) dup2(null, STDERR_FILENO);
+        execvp(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    if (first_output) {
+        // Commands that print nothing count their whole runtime
+        char buffer[65536];
+        ssize_t n;
+        close(out[1]);
+        *first_output = -1;
+        while ((n = read(out[0], buffer, sizeof(buffer))) != 0) {
+            if (n > 0 && *first_output < 0) *first_output = now_seconds() - start;
+        }
+        close(out[0]);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: '%s %s' failed\n", argv[0], args[0]);
+    }
+    double elapsed = now_seconds() - start;
+    if (first_output && *first_output < 0) *first_output = elapsed;
+    if (report) {
+        rewind(report);
+        parse_contention(report, contention);
+        fclose(report);
+    }
+    return elapsed;
+}
+
+static void write_file(const char *path, int size) {
+    FILE *f = fopen(path, "w");
+    if (!f) return;
+    for (int i = 0; i < size; i += 16) fprintf(f, "%015llx\n", (unsigned long long)(next_random() >> 4));
+    fclose(f);
+}
+
+/* Rewrites every tenth file and stages it, as vcs add would */
+static void modify_files(const Options *opt, int trial) {
+    FILE *index = fopen(".myvcs/index", "a");
+    for (int i = trial % 10; i < opt->files; i += 10) {
+        char path[64];
+        snprintf(path, sizeof(path), "file%05d.txt", i);
+        write_file(path, opt->size);
+        if (index) fprintf(index, "%s\n", path);
+    }
+    if (index) fclose(index);
+}
+
+/* The first file is modified, so status has to hash it and reports it first */
+static void touch_file(const Options *opt, int trial) {
+    (void)trial;
+    write_file("file00000.txt", opt->size);
+}
+
+/* Migrations alternate between two formats so every trial does the full job */
+static void flip_format(const Options *opt, int trial) {
+    (void)opt;
+    (void)trial;
+    snprintf(migrate_target, sizeof(migrate_target), "%s", strcmp(migrate_target, "blake3") ? "blake3" : "sha256");
+}
+
+static const Operation operations[] = {
+    {"commit", modify_files, 0, 0, {"commit", "bench", NULL}},
+    {"status", touch_file, 0, 1, {"status", NULL}},
+    {"checkout", NULL, 0, 0, {"checkout", "master", NULL}},
+    {"log", NULL, 0, 1, {"log", NULL}},
+    {"diff", NULL, 0, 1, {"diff", first_commit, "master", NULL}},
+    {"diff-stat", NULL, 1, 0, {"diff", first_commit, "master", "--stat"}},
+    {"fsck", NULL, 0, 0, {"fsck", NULL}},
+    {"sizer", NULL, 1, 0, {"sizer", "--json", NULL}},
+    {"migrate-hash", flip_format, 1, 0, {"migrate-hash", migrate_target, NULL}},
+};
+
+static int setup_repository(const Options *opt) {
+    const char *init[] = {"init", NULL};
+    run_vcs(opt, init, 0, NULL, NULL, NULL);
+    FILE *index = fopen(".myvcs/index", "w");
+    if (!index) return -1;
+    for (int i = 0; i < opt->files; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "file%05d.txt", i);
+        write_file(path, opt->size);
+        fprintf(index, "%s\n", path);
+    }
+    fclose(index);
+    const char *commit[] = {"commit", "initial", NULL};
+    run_vcs(opt, commit, 0, NULL, NULL, NULL);
+    FILE *id = fopen(".myvcs/commit_id", "r");
+    if (!id || !fgets(first_commit, sizeof(first_commit), id)) return -1;
+    fclose(id);
+
+    // A second commit touching a tenth of the files gives diff something to do
+    modify_files(opt, 0);
+    const char *second[] = {"commit", "second", NULL};
+    run_vcs(opt, second, 0, NULL, NULL, NULL);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/*
+ * Runs one operation for all trials; samples receives the wall times and
+ * first_output, when given, the times to first output. Cold trials start
+ * with the repository evicted from the page cache.
+ */
+static void measure(const Options *opt, const Operation *op, int threads, int cold, double *samples,
+                    double *first_output, Contention *contention) {
+    // One untimed run first so every warm sample sees warm caches
+    if (op->prepare) op->prepare(opt, opt->trials);
+    run_vcs(opt, op->args, threads, NULL, NULL, NULL);
+    static int warned = 0;
+    for (int t = 0; t < opt->trials; t++) {
+        char perf_data[PATH_MAX + 64];
+        int record = opt->perf_dir[0] && t == opt->trials - 1;
+        if (record) {
+            snprintf(perf_data, sizeof(perf_data), "%s/%s%s-%dt.data", opt->perf_dir, op->name, cold ? "-cold" : "",
+                     threads);
+        }
+        if (op->prepare) op->prepare(opt, t);
+        if (cold && evict_caches() > 0.1 && !warned++) {
+            fprintf(stderr, "bench: page cache eviction is not taking effect here (tmpfs?); try --dir\n");
+        }
+        samples[t] = run_vcs(opt, op->args, threads, record ? perf_data : NULL, contention,
+                             first_output ? &first_output[t] : NULL);
+    }
+}
+
+static void write_samples(FILE *out, const double *samples, int count) {
+    fprintf(out, "\"samples\": [");
+    for (int t = 0; t < count; t++) fprintf(out, "%s%.6f", t ? ", " : "", samples[t]);
+    fprintf(out, "]");
+}
+
+int main(int argc, char *argv[]) {
+    Options opt = {"./vcs", 1000, 4096, 10, "bench-results.json", 1, 1, "/tmp", 0, 0, ""};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.max_threads = cpus > 0 ? (int)cpus : 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--vcs") == 0 && i + 1 < argc) snprintf(opt.vcs, sizeof(opt.vcs), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) opt.files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) opt.size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--trials") == 0 && i + 1 < argc) opt.trials = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) opt.out = argv[++i];
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            opt.warm = strcmp(mode, "cold") != 0;
+            opt.cold = strcmp(mode, "warm") != 0;
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) snprintf(opt.dir, sizeof(opt.dir), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--scaling") == 0) opt.scaling = 1;
+        else if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc) opt.max_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--perf") == 0 && i + 1 < argc) {
+            if (!realpath(argv[++i], opt.perf_dir)) {
+                perror(argv[i]);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "usage: bench [--vcs <path>] [--files <n>] [--size <bytes>] [--trials <n>] [--out <file>]\n"
+                            "             [--cache warm|cold|both] [--dir <path>] [--scaling [--max-threads <n>]]\n"
+                            "             [--perf <dir>]\n");
+            return 2;
+        }
+    }
+    if (opt.trials < 1 || opt.files < 1 || opt.max_threads < 1) return 2;
+
+    char vcs[PATH_MAX], cwd[PATH_MAX], dir[PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s/vcs-bench-XXXXXX", opt.dir);
+    if (!realpath(opt.vcs, vcs) || !getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir)) {
+        perror("bench");
+        return 1;
+    }
+    snprintf(opt.vcs, sizeof(opt.vcs), "%s", vcs);
+    char out_path[PATH_MAX * 2];
+    snprintf(out_path, sizeof(out_path), "%s%s%s", opt.out[0] == '/' ? "" : cwd, opt.out[0] == '/' ? "" : "/", opt.out);
+    FILE *out = fopen(out_path, "w");
+    if (!out || chdir(dir) != 0 || setup_repository(&opt) != 0) {
+        perror("bench");
+        return 1;
+    }
+
+    fprintf(out, "{\"tool\": \"vcs-bench\", \"files\": %d, \"file_size\": %d, \"trials\": %d,\n \"results\": [",
+            opt.files, opt.size, opt.trials);
+    double *samples = malloc(sizeof(double) * opt.trials), *first_output = malloc(sizeof(double) * opt.trials);
+    int count = sizeof(operations) / sizeof(operations[0]), written = 0;
+    for (int k = 0; k < count; k++) {
+        const Operation *op = &operations[k];
+        if (opt.scaling && !op->threaded) continue;
+        if (!opt.scaling) {
+            for (int cold = !opt.warm; cold <= opt.cold; cold++) {
+                measure(&opt, op, 0, cold, samples, op->streams ? first_output : NULL, NULL);
+                fprintf(out, "%s\n  {\"op\": \"%s%s\", \"cache\": \"%s\", ", written++ ? "," : "", op->name,
+                        cold ? "/cold" : "", cold ? "cold" : "warm");
+                write_samples(out, samples, opt.trials);
+                fprintf(out, "}");
+                fprintf(stderr, "%-14s %-5s %9.3f ms median over %d trials", op->name, cold ? "cold" : "warm",
+                        median(samples, opt.trials) * 1000, opt.trials);
+                if (op->streams) {
+                    fprintf(out, ",\n  {\"op\": \"%s%s/ttfb\", \"cache\": \"%s\", ", op->name, cold ? "/cold" : "",
+                            cold ? "cold" : "warm");
+                    write_samples(out, first_output, opt.trials);
+                    fprintf(out, "}");
+                    fprintf(stderr, ", first output after %.3f ms", median(first_output, opt.trials) * 1000);
+                }
+                fprintf(stderr, "\n");
+            }
+            continue;
+        }
+
+        // Thread matrix: 1, 2, 4, ... and max_threads itself
+        double base = 0;
+        fprintf(stderr, "%-14s %7s %12s %8s %10s %6s %12s\n", op->name, "threads", "median", "speedup", "efficiency",
+                "busy", "lock wait");
+        for (int threads = 1;; threads = threads * 2 < opt.max_threads ? threads * 2 : opt.max_threads) {
+            Contention c = {0};
+            measure(&opt, op, threads, 0, samples, NULL, &c);
+            fprintf(out, "%s\n  {\"op\": \"%s@%dt\", \"threads\": %d, ", written++ ? "," : "", op->name, threads,
+                    threads);
+            write_samples(out, samples, opt.trials);
+            double m = median(samples, opt.trials);
+            if (threads == 1) base = m;
+            double speedup = m > 0 ? base / m : 0, efficiency = speedup / threads;
+            double busy = c.reports ? c.busy_pct / c.reports : 0;
+            double wait = c.reports ? c.lock_wait_ms / c.reports : 0;
+            fprintf(out, ", \"median\": %.6f, \"speedup\": %.3f, \"efficiency\": %.3f, \"busy_pct\": %.1f, "
+                         "\"lock_waits\": %ld, \"lock_wait_ms\": %.3f, \"largest_batch\": %ld}",
+                    m, speedup, efficiency, busy, c.reports ? c.lock_waits / c.reports : 0, wait, c.largest_batch);
+            fprintf(stderr, "%-14s %7d %9.3f ms %7.2fx %9.0f%% %5.0f%% %9.3f ms\n", "", threads, m * 1000, speedup,
+                    efficiency * 100, busy, wait);
+            if (threads >= opt.max_threads) break;
+        }
+    }
+    free(samples);
+    free(first_output);
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    if (chdir(cwd) == 0) {
+        char command[sizeof(dir) + 16];
+        snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+        if (system(command) != 0) fprintf(stderr, "bench: could not remove %s\n", dir);
+    }
+    return 0;
+}